@@ -1,11 +1,23 @@
 #define _GNU_SOURCE
 
 #include "minispark.h"
+#include "minispark_ext.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <sched.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
 
 typedef struct LinkedListNode
 {
@@ -131,7 +143,7 @@ int list_insert_at(List *l, void *elem, int index)
 
 void *get_nth_element(List *l, int n)
 {
-	if (n < 0 || n >= l->size) {
+	if (n < 0 || n >= l->capacity) { // partitions are inserted out of order, so size isn't the last index
 		return NULL;
 	}
 
@@ -143,12 +155,343 @@ void *get_nth_element(List *l, int n)
 	return current->ptr;
 }
 
+/* overwrites the nth slot regardless of what it held (unlike list_insert_at) */
+void set_nth_element(List *l, int n, void *elem)
+{
+	LinkedListNode *current = l->head;
+	for (int i = 0; i < n; i++) {
+		current = current->next;
+	}
+
+	pthread_mutex_lock(&l->linked_list_mutex);
+	if (current->ptr == NULL && elem != NULL) {
+		l->size++;
+	} else if (current->ptr != NULL && elem == NULL) {
+		l->size--;
+	}
+	current->ptr = elem;
+	pthread_mutex_unlock(&l->linked_list_mutex);
+}
+
+/* frees the list itself; the elements belong to whoever put them there */
+void list_free(List *l)
+{
+	LinkedListNode *current = l->head;
+	while (current) {
+		LinkedListNode *next = current->next;
+		free(current);
+		current = next;
+	}
+	pthread_mutex_destroy(&l->linked_list_mutex);
+	free(l);
+}
+
+/* Binary partition format used by checkpoints:
+ *   uint64 record count, then per record: uint32 length + `length` bytes */
+int write_partition(FILE *fp, List *part, Serializer fn)
+{
+	uint64_t records = 0;
+	for (LinkedListNode *current = part->head; current; current = current->next) {
+		if (current->ptr != NULL) {
+			records++;
+		}
+	}
+	if (fwrite(&records, sizeof(records), 1, fp) != 1) {
+		return -1;
+	}
+
+	for (LinkedListNode *current = part->head; current; current = current->next) {
+		if (current->ptr == NULL) {
+			continue;
+		}
+		size_t len = 0;
+		void *buf = fn(current->ptr, &len);
+		if (buf == NULL || len > UINT32_MAX) {
+			printf("Error: record could not be serialized\n");
+			free(buf);
+			return -1;
+		}
+		uint32_t len32 = len;
+		if (fwrite(&len32, sizeof(len32), 1, fp) != 1 || fwrite(buf, 1, len, fp) != len) {
+			free(buf);
+			return -1;
+		}
+		free(buf);
+	}
+	return 0;
+}
+
+/* frees a partition read so far, elements included, when the rest is corrupt */
+void discard_partition(List *part)
+{
+	for (LinkedListNode *current = part->head; current; current = current->next) {
+		free(current->ptr);
+	}
+	list_free(part);
+}
+
+List *read_partition(FILE *fp, Deserializer fn)
+{
+	uint64_t records;
+	if (fread(&records, sizeof(records), 1, fp) != 1 || records > INT_MAX) {
+		return NULL;
+	}
+
+	// the count comes from disk or a socket, so grow the list as records arrive
+	List *part = list_init(records > 0 && records < 1024 ? records : 1024);
+	for (uint64_t i = 0; i < records; i++) {
+		uint32_t len;
+		if (fread(&len, sizeof(len), 1, fp) != 1) {
+			discard_partition(part);
+			return NULL;
+		}
+		void *buf = malloc(len > 0 ? len : 1);
+		if (buf == NULL || fread(buf, 1, len, fp) != len) {
+			free(buf);
+			discard_partition(part);
+			return NULL;
+		}
+		void *elem = fn(buf, len);
+		free(buf);
+		if (elem == NULL) {
+			discard_partition(part);
+			return NULL;
+		}
+		list_add_elem(part, elem);
+	}
+	return part;
+}
+
 /* A special mapper */
 void *identity(void *arg)
 {
 	return arg;
 }
 
+/* splitmix64 finalizer, spreads weak user hashes and seeds over all 64 bits */
+uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/* ln(x) for x >= 1, enough for sizing sketches without pulling in libm */
+double natural_log(double x)
+{
+	int halvings = 0;
+	while (x >= 2) {
+		x /= 2;
+		halvings++;
+	}
+	// ln(x) = 2 atanh((x - 1) / (x + 1)), with (x - 1) / (x + 1) < 1/3
+	double t = (x - 1) / (x + 1);
+	double term = t, sum = 0;
+	for (int k = 1; k < 40; k += 2) {
+		sum += term / k;
+		term *= t * t;
+	}
+	return 2 * sum + halvings * 0.69314718055994530942;
+}
+
+/* HyperLogLog sketch over a partition: 2^precision registers, each holding
+ * the longest run of leading zeros (+1) seen among the hashes routed to it */
+typedef struct Sketch
+{
+	int precision;
+	unsigned char registers[];
+} Sketch;
+
+typedef struct SketchSpec
+{
+	Hasher fn;
+	int precision;
+} SketchSpec;
+
+/* Bloom filter over the join keys of a semiJoinFilter() RDD's second
+ * dependency, built once by the first of its tasks to run */
+typedef struct BloomSpec
+{
+	Hasher fn;    // join key of the records being filtered
+	Hasher keyfn; // join key of the records of the small side
+	double fpp;   // target false positive rate
+	uint64_t *bits;
+	uint64_t nbits;
+	int hashes;
+	pthread_mutex_t mutex;
+	struct Profile *build; // the build's own counters, a row of the profile table
+} BloomSpec;
+
+typedef struct SampleSpec
+{
+	double fraction;
+	uint64_t seed;
+} SampleSpec;
+
+/* Special mapper marking the RDDs built by countApproxDistinct; each of their
+ * tasks turns its input into a single Sketch (see transform_records). */
+void *build_sketch(void *arg)
+{
+	return arg;
+}
+
+/* Special filter marking the RDDs built by sample(); whether a record is kept
+ * only depends on the seed and its position, so re-runs keep the same ones. */
+int sample_records(void *arg, void *ctx)
+{
+	(void)arg;
+	(void)ctx;
+	return 1;
+}
+
+/* Special mappers marking the RDDs built by coalesce() and repartition(). Their
+ * partitions are gathered from a range of input partitions by
+ * rebalance_records rather than computed record by record. */
+void *coalesce_partitions(void *arg)
+{
+	return arg;
+}
+
+void *repartition_records(void *arg)
+{
+	return arg;
+}
+
+/* Special mapper marking the hidden RDD a repartition() RDD reads from; each of
+ * its tasks deals one input partition out into a single Deal (see
+ * deal_partition). */
+void *deal_records(void *arg)
+{
+	return arg;
+}
+
+/* The records of one input partition of a repartition(), dealt out by their
+ * position k in it: sub[k % n] holds the k-th record. Which output partition a
+ * sublist ends up in depends on the records of the partitions before it, see
+ * deal_slot. */
+typedef struct Deal
+{
+	int n;     // output partitions
+	long size; // records in the input partition
+	List *sub[]; // NULL if empty
+} Deal;
+
+Deal *deal_init(int n, long size)
+{
+	Deal *deal = calloc(1, sizeof(Deal) + n * sizeof(List *));
+	if (deal == NULL) {
+		printf("malloc error\n");
+		exit(1);
+	}
+	deal->n = n;
+	deal->size = size;
+	return deal;
+}
+
+/* frees a Deal and its sublists, not the records in them */
+void deal_free(Deal *deal)
+{
+	for (int r = 0; r < deal->n; r++) {
+		if (deal->sub[r]) {
+			list_free(deal->sub[r]);
+		}
+	}
+	free(deal);
+}
+
+/* the sublist of a Deal that goes to output partition pnum, when `offset`
+ * records come before it in the input */
+int deal_slot(int pnum, long offset, int n)
+{
+	return ((pnum - offset) % n + n) % n;
+}
+
+/* Special filter marking the RDDs built by semiJoinFilter() */
+int semi_join_records(void *arg, void *ctx)
+{
+	(void)arg;
+	(void)ctx;
+	return 1;
+}
+
+/* the i-th of the bloom filter's bit positions for a key hash (double hashing) */
+uint64_t bloom_bit(BloomSpec *spec, uint64_t hash, int i)
+{
+	return (hash + i * (mix64(hash) | 1)) % spec->nbits;
+}
+
+int bloom_contains(BloomSpec *spec, unsigned long key)
+{
+	uint64_t hash = mix64(key);
+	for (int i = 0; i < spec->hashes; i++) {
+		uint64_t bit = bloom_bit(spec, hash, i);
+		if (!(spec->bits[bit / 64] & (1ULL << (bit % 64)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+Sketch *sketch_init(int precision)
+{
+	Sketch *sketch = calloc(1, sizeof(Sketch) + (1 << precision));
+	if (sketch == NULL) {
+		printf("malloc error\n");
+		exit(1);
+	}
+	sketch->precision = precision;
+	return sketch;
+}
+
+void sketch_add(Sketch *sketch, uint64_t hash)
+{
+	int p = sketch->precision;
+	uint64_t rest = hash << p;
+	unsigned char rank = rest ? __builtin_clzll(rest) + 1 : 64 - p + 1;
+	if (rank > sketch->registers[hash >> (64 - p)]) {
+		sketch->registers[hash >> (64 - p)] = rank;
+	}
+}
+
+void *sketch_serialize(void *elem, size_t *len)
+{
+	Sketch *sketch = elem;
+	*len = sizeof(Sketch) + (1 << sketch->precision);
+	void *buf = malloc(*len);
+	memcpy(buf, sketch, *len);
+	return buf;
+}
+
+void *sketch_deserialize(void *buf, size_t len)
+{
+	void *sketch = malloc(len);
+	memcpy(sketch, buf, len);
+	return sketch;
+}
+
+void *deal_serialize(void *elem, size_t *len); // defined with the executors below
+void *deal_deserialize(void *buf, size_t len);
+
+/* Sketch partitions cross the executor sockets as registers and Deals as
+ * their sublists, not as user records */
+Serializer partition_serializer(RDD *rdd, Serializer fn)
+{
+	if (rdd->fn == build_sketch) {
+		return sketch_serialize;
+	}
+	return rdd->fn == deal_records ? deal_serialize : fn;
+}
+
+Deserializer partition_deserializer(RDD *rdd, Deserializer fn)
+{
+	if (rdd->fn == build_sketch) {
+		return sketch_deserialize;
+	}
+	return rdd->fn == deal_records ? deal_deserialize : fn;
+}
+
 /* checks if all partitions have been materialized */
 int contains_unmaterialized(int *ismaterialized, int num_partitions)
 {
@@ -160,6 +503,398 @@ int contains_unmaterialized(int *ismaterialized, int num_partitions)
 	return 0;
 }
 
+/* Hot-path counters of the task running on the current worker, summed per RDD
+ * into a profile table (profile.log) at the end of each job, see
+ * profile_report. They are only compiled in when building with -DMS_PROFILE,
+ * as timing user code costs two clock reads per call. */
+typedef struct Profile
+{
+	long tasks;
+	long records_in;
+	long records_out;
+	long bytes_in;    // read from input files
+	long user_nanos;  // inside the Mapper/Filter/Joiner/Partitioner
+	long lock_nanos;  // waiting for partition list locks
+	long run_nanos;   // whole task, so engine overhead is run - user - lock
+	long queue_nanos; // between being queued and picked up by a worker
+} Profile;
+
+Profile unattributed_profile; // for work done outside of pool tasks, e.g. in executors
+__thread Profile *prof = &unattributed_profile;
+
+#define TIME_DIFF_NANOS(start, end) \
+	(((end.tv_sec - start.tv_sec) * 1000000000L) + (end.tv_nsec - start.tv_nsec))
+#define TIMEVAL_NANOS(tv) ((tv).tv_sec * 1000000000L + (tv).tv_usec * 1000L)
+
+#ifdef MS_PROFILE
+#define PROFILE_ADD(field, n) (prof->field += (n))
+#define PROFILE_TIME(field, stmt)                         \
+	do {                                                  \
+		struct timespec start_, end_;                     \
+		clock_gettime(CLOCK_MONOTONIC, &start_);          \
+		stmt;                                             \
+		clock_gettime(CLOCK_MONOTONIC, &end_);            \
+		prof->field += TIME_DIFF_NANOS(start_, end_);     \
+	} while (0)
+// takes the time of stmt back out of a PROFILE_TIME around it
+#define PROFILE_EXCLUDE(field, stmt)                      \
+	do {                                                  \
+		struct timespec xstart_, xend_;                   \
+		clock_gettime(CLOCK_MONOTONIC, &xstart_);         \
+		stmt;                                             \
+		clock_gettime(CLOCK_MONOTONIC, &xend_);           \
+		prof->field -= TIME_DIFF_NANOS(xstart_, xend_);   \
+	} while (0)
+#else
+#define PROFILE_ADD(field, n)
+#define PROFILE_TIME(field, stmt) stmt
+#define PROFILE_EXCLUDE(field, stmt) stmt
+#endif
+#define PROFILE_LOCK(mutex) PROFILE_TIME(lock_nanos, pthread_mutex_lock(mutex))
+
+/* sizes the bloom filter for the records of keys and adds all their keys */
+void bloom_fill(BloomSpec *spec, RDD *keys)
+{
+	long records = 0;
+	PROFILE_LOCK(&keys->list_prot);
+	for (LinkedListNode *part = keys->partitions->head; part; part = part->next) {
+		if (part->ptr != NULL) {
+			records += ((List *)part->ptr)->size;
+		}
+	}
+	pthread_mutex_unlock(&keys->list_prot);
+
+	// optimal size is -n ln(fpp) / ln(2)^2 bits with (bits / n) ln(2) hash functions
+	double ln2 = 0.69314718055994530942;
+	double bits_per_key = natural_log(1 / spec->fpp) / (ln2 * ln2);
+	spec->nbits = ((uint64_t)((records > 0 ? records : 1) * bits_per_key) / 64 + 1) * 64;
+	spec->hashes = bits_per_key * ln2 + 0.5;
+	if (spec->hashes < 1) {
+		spec->hashes = 1;
+	}
+	spec->bits = calloc(spec->nbits / 64, sizeof(uint64_t));
+	if (spec->bits == NULL) {
+		printf("malloc error\n");
+		exit(1);
+	}
+
+	for (LinkedListNode *part = keys->partitions->head; part; part = part->next) {
+		if (part->ptr == NULL) {
+			continue;
+		}
+		for (LinkedListNode *current = ((List *)part->ptr)->head; current; current = current->next) {
+			if (current->ptr == NULL) {
+				continue;
+			}
+			unsigned long key;
+			PROFILE_ADD(records_in, 1);
+			PROFILE_TIME(user_nanos, key = spec->keyfn(current->ptr));
+			uint64_t hash = mix64(key);
+			for (int i = 0; i < spec->hashes; i++) {
+				uint64_t bit = bloom_bit(spec, hash, i);
+				spec->bits[bit / 64] |= 1ULL << (bit % 64);
+			}
+		}
+	}
+}
+
+/* Builds the bloom filter of a semiJoinFilter() RDD unless another task
+ * already has. It is sized for the small side's actual record count. The
+ * build reads the small side, not the task's input, so it is profiled on a
+ * row of its own rather than in the counters of the task that ran it. */
+void bloom_build(RDD *rdd)
+{
+	BloomSpec *spec = rdd->ctx;
+	PROFILE_LOCK(&spec->mutex);
+	if (spec->bits != NULL) {
+		pthread_mutex_unlock(&spec->mutex);
+		return;
+	}
+
+	Profile *task_prof = prof;
+	prof = spec->build;
+	PROFILE_TIME(run_nanos, bloom_fill(spec, rdd->dependencies[1]));
+	prof = task_prof;
+	PROFILE_ADD(run_nanos, -spec->build->run_nanos);
+	pthread_mutex_unlock(&spec->mutex);
+}
+
+/* Set once another copy of a speculated task published the partition; the
+ * loser stops at the next record and its output is dropped. Only checked in
+ * the driver, executors run their tasks to the end. */
+extern struct ExecutorPool *executor_pool; // defined with the executors below
+#define SUPERSEDED(rdd, pnum) (!executor_pool && __atomic_load_n(&(rdd)->ismaterialized[pnum], __ATOMIC_RELAXED))
+
+/* applies a MAP or FILTER to the records of partition pnum of `input` at
+ * positions [start, end) */
+void transform_records(RDD *rdd, int pnum, List *input, int start, int end, List *output)
+{
+	LinkedListNode *current = input->head;
+	for (int i = 0; i < start && current; i++) {
+		current = current->next;
+	}
+
+	Sketch *sketch = NULL;
+	if (rdd->fn == build_sketch) {
+		sketch = sketch_init(((SketchSpec *)rdd->ctx)->precision);
+	} else if (rdd->fn == semi_join_records) {
+		bloom_build(rdd);
+	}
+
+	for (int i = start; i < end && current && !SUPERSEDED(rdd, pnum); i++, current = current->next) {
+		if (current->ptr == NULL) {
+			continue;
+		}
+		void *result = NULL;
+		PROFILE_ADD(records_in, 1);
+		if (sketch) {
+			unsigned long hash;
+			PROFILE_TIME(user_nanos, hash = ((SketchSpec *)rdd->ctx)->fn(current->ptr));
+			sketch_add(sketch, mix64(hash));
+		} else if (rdd->fn == semi_join_records) {
+			unsigned long key;
+			PROFILE_TIME(user_nanos, key = ((BloomSpec *)rdd->ctx)->fn(current->ptr));
+			if (bloom_contains(rdd->ctx, key)) {
+				result = current->ptr;
+			}
+		} else if (rdd->fn == sample_records) {
+			SampleSpec *spec = rdd->ctx;
+			uint64_t draw = mix64(spec->seed ^ mix64(((uint64_t)pnum << 32) | (uint32_t)i));
+			if ((draw >> 11) * (1.0 / (1ULL << 53)) < spec->fraction) {
+				result = current->ptr;
+			}
+		} else if (rdd->trans == MAP) {
+			PROFILE_TIME(user_nanos, result = ((Mapper)rdd->fn)(current->ptr));
+		} else if (rdd->trans == FILTER) {
+			int keep;
+			PROFILE_TIME(user_nanos, keep = ((Filter)rdd->fn)(current->ptr, rdd->ctx));
+			if (keep) {
+				result = current->ptr;
+			}
+		}
+
+		if (result) {
+			PROFILE_ADD(records_out, 1);
+			list_add_elem(output, result);
+		}
+	}
+
+	if (sketch) { // one per task, or per chunk of a split partition; they are merged by the driver
+		PROFILE_ADD(records_out, 1);
+		list_add_elem(output, sketch);
+	}
+}
+
+/* joins the records of partition pnum of `outer` at positions [start, end)
+ * against all of `inner` */
+void join_records(RDD *rdd, int pnum, List *outer, int start, int end, List *inner, List *output)
+{
+	LinkedListNode *current = outer->head;
+	for (int i = 0; i < start && current; i++) {
+		current = current->next;
+	}
+
+	if (start == 0) { // the whole inner side is an input of every chunk, count it once
+		PROFILE_ADD(records_in, inner->size);
+	}
+
+	for (int i = start; i < end && current && !SUPERSEDED(rdd, pnum); i++, current = current->next) {
+		if (current->ptr == NULL) {
+			continue;
+		}
+		PROFILE_ADD(records_in, 1);
+		// timed per outer record, as most pairs don't match and timing each
+		// Joiner call would cost more than the call; appends are taken out
+		PROFILE_TIME(user_nanos,
+			for (LinkedListNode *other = inner->head; other; other = other->next) {
+				if (other->ptr == NULL) {
+					continue;
+				}
+				void *result = ((Joiner)rdd->fn)(current->ptr, other->ptr, rdd->ctx);
+				if (result) {
+					PROFILE_ADD(records_out, 1);
+					PROFILE_EXCLUDE(user_nanos, list_add_elem(output, result));
+				}
+			});
+	}
+}
+
+/* marks the partition(s) produced by a task as materialized */
+void mark_materialized(RDD *rdd, int pnum)
+{
+	if (rdd->trans == PARTITIONBY) {
+		pthread_mutex_lock(&rdd->list_prot);
+		for (int i = 0; i < rdd->numpartitions; i++) {
+			rdd->ismaterialized[i] = 1;
+		}
+		rdd->fullymaterialized = 1;
+		pthread_mutex_unlock(&rdd->list_prot);
+	} else {
+		pthread_mutex_lock(&rdd->list_prot);
+		rdd->ismaterialized[pnum] = 1;
+		// check if all partitions are done
+		if (contains_unmaterialized(rdd->ismaterialized, rdd->partitions->capacity) == 0) {
+			rdd->fullymaterialized = 1;
+		}
+		pthread_mutex_unlock(&rdd->list_prot);
+	}
+}
+
+/* Stores a task's output partition and marks it materialized, unless another
+ * copy of the same task (see speculate_stragglers) published it first, in
+ * which case this output is dropped. The engine doesn't own user records (a
+ * Mapper may return its argument, a Filter always does), so only sketches are
+ * freed with it. Returns 1 if this output was published. */
+int publish_partition(RDD *rdd, int pnum, List *output)
+{
+	pthread_mutex_lock(&rdd->list_prot);
+	int won = get_nth_element(rdd->partitions, pnum) == NULL;
+	if (won) {
+		set_nth_element(rdd->partitions, pnum, output);
+	}
+	pthread_mutex_unlock(&rdd->list_prot);
+
+	if (!won) {
+		if (rdd->fn == build_sketch) {
+			discard_partition(output);
+		} else {
+			if (rdd->fn == deal_records) {
+				deal_free(output->head->ptr);
+			}
+			list_free(output);
+		}
+		return 0;
+	}
+	mark_materialized(rdd, pnum);
+	return 1;
+}
+
+/* the partitions [*dfirst, *dlast) of rdd's dependency `dep` that its
+ * partitions [first, last) are built from */
+void input_range(RDD *rdd, int dep, int first, int last, int *dfirst, int *dlast)
+{
+	int n = rdd->dependencies[dep]->partitions->capacity;
+	if (last > rdd->partitions->capacity) {
+		last = rdd->partitions->capacity;
+	}
+
+	if (rdd->trans == PARTITIONBY || rdd->fn == repartition_records || (rdd->fn == semi_join_records && dep == 1)) {
+		*dfirst = 0;
+		*dlast = n;
+	} else if (rdd->fn == coalesce_partitions) { // contiguous, evenly sized runs of input partitions
+		*dfirst = (long)first * n / rdd->numpartitions;
+		*dlast = (long)last * n / rdd->numpartitions;
+	} else {
+		*dfirst = first;
+		*dlast = last;
+	}
+}
+
+/* Builds partition pnum of the RDD a repartition() reads from: deals input
+ * partition pnum out round-robin into a Deal, the only element of the output. */
+List *deal_partition(RDD *rdd, int pnum)
+{
+	RDD *dep = rdd->dependencies[0];
+	int n = *(int *)rdd->ctx;
+
+	PROFILE_LOCK(&dep->list_prot);
+	List *input = get_nth_element(dep->partitions, pnum);
+	pthread_mutex_unlock(&dep->list_prot);
+
+	Deal *deal = deal_init(n, 0);
+	for (LinkedListNode *current = input->head; current; current = current->next) {
+		if (current->ptr == NULL) {
+			continue;
+		}
+		PROFILE_ADD(records_in, 1);
+		List **sub = &deal->sub[deal->size++ % n];
+		if (*sub == NULL) {
+			*sub = list_init(input->size / n + 1);
+		}
+		list_add_elem(*sub, current->ptr);
+	}
+	PROFILE_ADD(records_out, deal->size);
+
+	List *output = list_init(1);
+	list_add_elem(output, deal);
+	return output;
+}
+
+/* Builds partition pnum of a repartition() RDD from the Deals of all input
+ * partitions. A record's global position is its position in its Deal plus
+ * the sizes of the Deals before it, and output pnum takes the records whose
+ * global position is pnum modulo n, so output sizes differ by at most one. */
+List *gather_records(RDD *rdd, int pnum)
+{
+	RDD *dep = rdd->dependencies[0];
+	int numinputs = dep->partitions->capacity;
+	int n = rdd->numpartitions;
+
+	List **subs = malloc(numinputs * sizeof(List *));
+	long offset = 0, records = 0;
+	PROFILE_LOCK(&dep->list_prot);
+	for (int i = 0; i < numinputs; i++) {
+		Deal *deal = ((List *)get_nth_element(dep->partitions, i))->head->ptr;
+		subs[i] = deal->sub[deal_slot(pnum, offset, n)];
+		offset += deal->size;
+		records += subs[i] ? subs[i]->size : 0;
+	}
+	pthread_mutex_unlock(&dep->list_prot);
+
+	List *output = list_init(records > 0 ? records : 1);
+	for (int i = 0; i < numinputs; i++) {
+		if (subs[i] == NULL) {
+			continue;
+		}
+		for (LinkedListNode *current = subs[i]->head; current; current = current->next) {
+			if (current->ptr == NULL) {
+				continue;
+			}
+			PROFILE_ADD(records_in, 1);
+			PROFILE_ADD(records_out, 1);
+			list_add_elem(output, current->ptr);
+		}
+	}
+	free(subs);
+	return output;
+}
+
+/* Builds partition pnum of a coalesce() or repartition() RDD. coalesce
+ * concatenates its run of input partitions in order. */
+List *rebalance_records(RDD *rdd, int pnum)
+{
+	if (rdd->fn == repartition_records) {
+		return gather_records(rdd, pnum);
+	}
+
+	RDD *dep = rdd->dependencies[0];
+	int first, last;
+	input_range(rdd, 0, pnum, pnum + 1, &first, &last);
+
+	List **inputs = malloc((last - first + 1) * sizeof(List *));
+	long records = 0;
+	PROFILE_LOCK(&dep->list_prot);
+	for (int i = first; i < last; i++) {
+		inputs[i - first] = get_nth_element(dep->partitions, i);
+		records += inputs[i - first]->size;
+	}
+	pthread_mutex_unlock(&dep->list_prot);
+
+	List *output = list_init(records > 0 ? records : 1);
+	for (int i = first; i < last; i++) {
+		for (LinkedListNode *current = inputs[i - first]->head; current; current = current->next) {
+			if (current->ptr == NULL) {
+				continue;
+			}
+			PROFILE_ADD(records_in, 1);
+			PROFILE_ADD(records_out, 1);
+			list_add_elem(output, current->ptr);
+		}
+	}
+	free(inputs);
+	return output;
+}
+
 void iter_list(Task *task) // jump
 {
 	RDD *rdd = task->rdd;
@@ -167,7 +902,11 @@ void iter_list(Task *task) // jump
 	Transform trans = rdd->trans;
 	void *transform_fn = rdd->fn;
 
-	if (trans == MAP || trans == FILTER) {
+	if (transform_fn == coalesce_partitions || transform_fn == repartition_records) {
+		publish_partition(rdd, pnum, rebalance_records(rdd, pnum));
+	} else if (transform_fn == deal_records) {
+		publish_partition(rdd, pnum, deal_partition(rdd, pnum));
+	} else if (trans == MAP || trans == FILTER) {
 		if (rdd->partitions == NULL) {
 			rdd->partitions = list_init(rdd->dependencies[0]->partitions->capacity);
 		}
@@ -176,43 +915,32 @@ void iter_list(Task *task) // jump
 		List *output_partition = list_init(10);
 
 		if (dep->trans == MAP && dep->fn == identity) {
-			pthread_mutex_lock(&dep->list_prot);
+			PROFILE_LOCK(&dep->list_prot);
 			FILE *fp = get_nth_element(dep->partitions, pnum);
 			pthread_mutex_unlock(&dep->list_prot);
+			long offset = ftell(fp);
 			void* line;
-			while ((line = ((Mapper)transform_fn)(fp)) != NULL) {
+			while (1) {
+				PROFILE_TIME(user_nanos, line = ((Mapper)transform_fn)(fp));
+				if (line == NULL) {
+					break;
+				}
+				PROFILE_ADD(records_in, 1);
+				PROFILE_ADD(records_out, 1);
 				list_add_elem(output_partition, line);
 			}
+			if (offset >= 0 && ftell(fp) >= offset) {
+				PROFILE_ADD(bytes_in, ftell(fp) - offset);
+			}
 		} else { // Handle normal List case
-			pthread_mutex_lock(&dep->list_prot);
+			PROFILE_LOCK(&dep->list_prot);
 			List *input_partition = get_nth_element(dep->partitions, pnum);
 			pthread_mutex_unlock(&dep->list_prot);
-			LinkedListNode *current = input_partition->head;
-			while (current) {
-				if (current->ptr == NULL) {
-					current = current->next;
-					continue;
-				}
-				void *result;
-				if (trans == MAP) {
-					result = ((Mapper)transform_fn)(current->ptr);
-				} else if (trans == FILTER) {
-					if (((Filter)transform_fn)(current->ptr, rdd->ctx)) {
-						result = current->ptr;
-					} else {
-						result = NULL;
-					}
-				}
-
-				if (result) {
-					list_add_elem(output_partition, result);
-				}
-				current = current->next;
-			}
+			transform_records(rdd, pnum, input_partition, 0, INT_MAX, output_partition);
 		}
 
 		// Store the result
-		list_insert_at(rdd->partitions, output_partition, pnum);
+		publish_partition(rdd, pnum, output_partition);
 	} else if (trans == JOIN) {
 		if (rdd->partitions == NULL) {
 			rdd->partitions = list_init(rdd->dependencies[0]->partitions->capacity);
@@ -220,37 +948,17 @@ void iter_list(Task *task) // jump
 
 		RDD *dep1 = rdd->dependencies[0];
 		RDD *dep2 = rdd->dependencies[1];
-		pthread_mutex_lock(&dep1->list_prot);
-		pthread_mutex_lock(&dep2->list_prot);
+		PROFILE_LOCK(&dep1->list_prot);
+		PROFILE_LOCK(&dep2->list_prot);
 		List *part1 = get_nth_element(dep1->partitions, pnum);
 		List *part2 = get_nth_element(dep2->partitions, pnum);
 		pthread_mutex_unlock(&dep2->list_prot);
 		pthread_mutex_unlock(&dep1->list_prot);
 
 		List *output_partition = list_init(10); // arbitrary number, will be doubled as needed
+		join_records(rdd, pnum, part1, 0, INT_MAX, part2, output_partition);
 
-		LinkedListNode *outer = part1->head;
-		while (outer) {
-			if (outer->ptr == NULL) {
-				outer = outer->next;
-				continue;
-			}
-			LinkedListNode *inner = part2->head;
-			while (inner) {
-				if (inner->ptr == NULL) {
-					inner = inner->next;
-					continue;
-				}
-				void *result = ((Joiner)transform_fn)(outer->ptr, inner->ptr, rdd->ctx);
-				if (result) {
-					list_add_elem(output_partition, result);
-				}
-				inner = inner->next;
-			}
-			outer = outer->next;
-		}
-
-		list_insert_at(rdd->partitions, output_partition, pnum);
+		publish_partition(rdd, pnum, output_partition);
 	} else if (trans == PARTITIONBY) {
 		if (rdd->partitions == NULL) {
 			rdd->partitions = list_init(rdd->numpartitions);
@@ -267,7 +975,7 @@ void iter_list(Task *task) // jump
 
 		// process all input partitions, adds them to the correct partition (returned by Partitioner), only 1 task for this
 		for (int i = 0; i < dep->partitions->capacity; i++) {
-			pthread_mutex_lock(&dep->list_prot);
+			PROFILE_LOCK(&dep->list_prot);
 			List *input_part = get_nth_element(dep->partitions, i);
 			pthread_mutex_unlock(&dep->list_prot);
 			LinkedListNode *current = input_part->head;
@@ -277,35 +985,99 @@ void iter_list(Task *task) // jump
 					current = current->next;
 					continue;
 				}
-				unsigned long target_part = ((Partitioner)transform_fn)(
+				unsigned long target_part;
+				PROFILE_ADD(records_in, 1);
+				PROFILE_TIME(user_nanos, target_part = ((Partitioner)transform_fn)(
 					current->ptr,
 					rdd->numpartitions,
-					rdd->ctx);
-				pthread_mutex_lock(&rdd->list_prot);
+					rdd->ctx));
+				PROFILE_LOCK(&rdd->list_prot);
 				List *target = get_nth_element(rdd->partitions, target_part);
 				pthread_mutex_unlock(&rdd->list_prot);
+				PROFILE_ADD(records_out, 1);
 				list_add_elem(target, current->ptr);
 				current = current->next;
 			}
 		}
+
+		mark_materialized(rdd, pnum);
 	}
+}
 
-	if (rdd->trans == PARTITIONBY) {
-		pthread_mutex_lock(&rdd->list_prot);
-		for (int i = 0; i < rdd->numpartitions; i++) {
-			rdd->ismaterialized[i] = 1;
-		}
-		rdd->fullymaterialized = 1;
-		pthread_mutex_unlock(&rdd->list_prot);
+/* An oversized partition is processed by several sub-tasks, each covering a
+ * chunk of its input. The Split collects their outputs until the last one
+ * finishes, which publishes the merged partition as if one task had run. */
+typedef struct Split
+{
+	int chunks;
+	int remaining;
+	List **outputs; // one per chunk, in input order
+	pthread_mutex_t mutex;
+} Split;
+
+/* What the scheduler actually allocates for every Task; the public Task comes
+ * first so the rest of the engine can keep passing Task pointers around. */
+typedef struct TaskState
+{
+	Task task;
+	struct Job *job;
+	Split *split; // NULL unless this is a sub-task of a skewed partition
+	int chunk;
+	int start, end; // input record positions [start, end) of the chunk
+	struct timespec started;
+	int speculated; // a copy of this task has been queued
+	int copy;       // this task is the speculative copy
+	Profile profile;
+} TaskState;
+
+/* runs one chunk of a split partition; the last chunk to finish merges them */
+void run_chunk(TaskState *state)
+{
+	RDD *rdd = state->task.rdd;
+	int pnum = state->task.pnum;
+	Split *split = state->split;
+	List *output = list_init(10);
+
+	PROFILE_LOCK(&rdd->dependencies[0]->list_prot);
+	List *input = get_nth_element(rdd->dependencies[0]->partitions, pnum);
+	pthread_mutex_unlock(&rdd->dependencies[0]->list_prot);
+
+	if (rdd->trans == JOIN) {
+		PROFILE_LOCK(&rdd->dependencies[1]->list_prot);
+		List *inner = get_nth_element(rdd->dependencies[1]->partitions, pnum);
+		pthread_mutex_unlock(&rdd->dependencies[1]->list_prot);
+		join_records(rdd, pnum, input, state->start, state->end, inner, output);
 	} else {
-		pthread_mutex_lock(&rdd->list_prot);
-		rdd->ismaterialized[pnum] = 1;
-		// check if all partitions are done
-		if (contains_unmaterialized(rdd->ismaterialized, rdd->partitions->capacity) == 0) {
-			rdd->fullymaterialized = 1;
+		transform_records(rdd, pnum, input, state->start, state->end, output);
+	}
+
+	PROFILE_LOCK(&split->mutex);
+	split->outputs[state->chunk] = output;
+	int last = --split->remaining == 0;
+	pthread_mutex_unlock(&split->mutex);
+	if (!last) {
+		return;
+	}
+
+	int total = 0;
+	for (int c = 0; c < split->chunks; c++) {
+		total += split->outputs[c]->size;
+	}
+
+	List *merged = list_init(total > 0 ? total : 1);
+	for (int c = 0; c < split->chunks; c++) {
+		for (LinkedListNode *current = split->outputs[c]->head; current; current = current->next) {
+			if (current->ptr != NULL) {
+				list_add_elem(merged, current->ptr);
+			}
 		}
-		pthread_mutex_unlock(&rdd->list_prot);
+		list_free(split->outputs[c]); // its records now belong to merged
 	}
+
+	publish_partition(rdd, pnum, merged);
+	pthread_mutex_destroy(&split->mutex);
+	free(split->outputs);
+	free(split);
 }
 
 typedef struct Node
@@ -318,18 +1090,71 @@ typedef struct Queue
 {
 	Node *head;
 	Node *tail;
-	pthread_mutex_t mutex; // for popping the head and updating into the new head
-	pthread_cond_t cond;   // for waking up the threads when a task is added to the queue
 } Queue;
 
+/* A job is one action (execute) running on the shared pool, with its own task
+ * queue. Workers take tasks from the job with the fewest running tasks per
+ * unit of weight, so concurrent jobs share the pool in proportion to their
+ * weights. Everything in here is protected by the pool mutex. */
+struct Job // typedef'd in minispark_ext.h
+{
+	long id;
+	RDD *rdd;
+	int weight;
+	int want;  // only the first `want` partitions of rdd are needed
+	int limit; // if > 0, done as soon as the leading materialized partitions hold this many records
+	Queue queue;
+	int running; // tasks of this job currently on a worker
+	int done;    // rdd is fully materialized, or the job failed
+	int failed;  // a task gave up (see run_remote), so rdd never will be
+	pthread_cond_t done_cond; // also broadcast when the last task of a done job finishes
+	struct Job *next;
+};
+
+typedef struct FinishedTask {
+	RDD *rdd;
+	long job; // id of the job that ran it
+	int split; // chunk of a split partition, not representative for speculation
+	long duration; // usec spent running, excluding queue wait
+	Profile profile;
+} FinishedTask;
+
+/* How much of the task a worker is running is already in the pool's window.
+ * adapt_pool moves the marks forward when it counts a task still running. */
+typedef struct TaskClock {
+	int busy;
+	struct timespec since;
+	long cpu_since; // thread CPU time
+} TaskClock;
+
 typedef struct ThreadPool {
-    Queue* work_queue;
+    Job *jobs; /* jobs that still have partitions to materialize */
+    pthread_mutex_t mutex; /* scheduling lock: jobs, their queues and RDD scheduling state */
+    pthread_cond_t work_cond; /* for waking up the threads when a task is queued */
     pthread_t *threads;
-    int *thread_status; /* 0 = ready, 1 = working, -1 = terminate */
+    int *thread_status; /* 0 = ready, 1 = working, -1 = terminate, -2 = retired (not joined yet), -3 = no thread */
     pthread_mutex_t status_mutex;
-	pthread_cond_t main_cond;
-    int num_threads;
+	pthread_cond_t main_cond; /* broadcast whenever a worker finishes a task */
+    int num_threads; /* current size, workers in slots at or above it retire (see adapt_pool) */
+	int min_threads, max_threads; /* bounds of num_threads, the arrays hold max_threads slots */
+	int cores;
     int active_count;
+	int queued; /* tasks in all job queues */
+	TaskState **running; /* task each thread is working on, protected by status_mutex */
+	TaskClock *clocks; /* per thread, protected by mutex */
+	FinishedTask *finished; /* completed tasks of running jobs, for speculation and profiling */
+	int num_finished;
+	int finished_capacity;
+	long num_jobs; /* ever submitted, used as job ids */
+	struct timespec window_start; /* what tasks did since then, see adapt_pool */
+	long window_task_nanos;
+	long window_cpu_nanos;
+	long window_voluntary;   /* context switches while waiting for I/O, locks, ... */
+	long window_involuntary; /* context switches to let other threads run */
+	long total_task_nanos;   /* for the utilization reported at teardown */
+	long thread_nanos;       /* integral of num_threads over time */
+	int resizes;
+	int smallest, largest;
 } ThreadPool;
 
 struct ThreadPool *threads;
@@ -360,9 +1185,12 @@ typedef struct MetricQueue {
     MetricNode *tail;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+	pthread_cond_t drained; // signaled when the queue empties and nothing is being printed
+	int printing;
 	pthread_t thread;
 	int status; // 0 when the RDD is fully set
 	FILE* fp;
+	FILE* profile_fp; // per-job profile tables, written under mutex
 } MetricQueue;
 
 /* only 1 thread will be surveying this area */
@@ -381,206 +1209,904 @@ void* metric_thread_function() {
 		if (metric_queue->head == NULL) {
 			metric_queue->tail = NULL;
 		}
+		metric_queue->printing = 1;
 		pthread_mutex_unlock(&metric_queue->mutex);
 		print_formatted_metric(node->metric, metric_queue->fp);
 		free(node->metric);
 		free(node);
+
+		pthread_mutex_lock(&metric_queue->mutex);
+		metric_queue->printing = 0;
+		if (metric_queue->head == NULL) {
+			pthread_cond_broadcast(&metric_queue->drained);
+		}
+		pthread_mutex_unlock(&metric_queue->mutex);
+	}
+	return NULL;
+}
+
+/* Waits until every metric queued so far has been printed. Metrics point to
+ * their RDD, so an RDD can only be freed once none of its metrics are left. */
+void metric_queue_flush() {
+	pthread_mutex_lock(&metric_queue->mutex);
+	while (metric_queue->head != NULL || metric_queue->printing) {
+		pthread_cond_wait(&metric_queue->drained, &metric_queue->mutex);
+	}
+	pthread_mutex_unlock(&metric_queue->mutex);
+}
+
+void metric_queue_init() {
+    metric_queue = malloc(sizeof(MetricQueue));
+	metric_queue->status = 1;
+	metric_queue->printing = 0;
+	metric_queue->fp = fopen("metrics.log", "w");
+	if (metric_queue->fp == NULL) {
+		printf("fopen");
+		exit(-1);
+	}
+#ifdef MS_PROFILE
+	metric_queue->profile_fp = fopen("profile.log", "w");
+	if (metric_queue->profile_fp == NULL) {
+		printf("fopen");
+		exit(-1);
+	}
+#endif
+    metric_queue->head = metric_queue->tail = NULL;
+    pthread_mutex_init(&metric_queue->mutex, NULL);
+    pthread_cond_init(&metric_queue->cond, NULL);
+	pthread_cond_init(&metric_queue->drained, NULL);
+	if (pthread_create(&metric_queue->thread, NULL, metric_thread_function, NULL) != 0) {
+		printf("pthread_create");
+		exit(-1);
+	}
+}
+
+void metric_queue_add(TaskMetric* taskmetric) {
+	pthread_mutex_lock(&metric_queue->mutex);
+	MetricNode* temp = malloc(sizeof(MetricNode));
+	temp->metric = taskmetric;
+	temp->next = NULL;
+	MetricNode* tail = metric_queue->tail;
+	if (tail == NULL) {
+		metric_queue->head = temp;
+		metric_queue->tail = temp;
+	} else {
+		metric_queue->tail->next = temp;
+		metric_queue->tail = temp;
+	}
+	pthread_cond_signal(&metric_queue->cond);
+	pthread_mutex_unlock(&metric_queue->mutex);
+}
+
+void metric_queue_clean() {
+	pthread_mutex_lock(&metric_queue->mutex);
+	metric_queue->status = 0;
+	pthread_cond_signal(&metric_queue->cond);
+	pthread_mutex_unlock(&metric_queue->mutex);
+
+	pthread_join(metric_queue->thread, NULL);
+	fclose(metric_queue->fp);
+#ifdef MS_PROFILE
+	fclose(metric_queue->profile_fp);
+#endif
+	pthread_mutex_destroy(&metric_queue->mutex);
+	pthread_cond_destroy(&metric_queue->cond);
+	pthread_cond_destroy(&metric_queue->drained);
+	MetricNode *current = metric_queue->head;
+	while (current != NULL) {
+		MetricNode *temp = current;
+		current = current->next;
+		free(temp->metric);
+		free(temp);
+	}
+	free(metric_queue);
+}
+
+/* Executor mode: tasks run in forked executor processes instead of on the pool
+ * threads, so a user function that crashes only takes its executor down. Each
+ * pool thread owns one executor and proxies the tasks it pops over a Unix
+ * socket pair, so all scheduling stays in the driver. Executors are forked at
+ * the start of every job, which makes the DAG, the user functions and their
+ * ctx valid inside them. Partitions cross the socket in the checkpoint format,
+ * so the Serializer/Deserializer pair must handle every element type flowing
+ * through the DAG.
+ *
+ * Tasks name their RDD by its address in the driver, which is only valid in a
+ * forked copy of it, so executors always run on the driver's machine. */
+#define EXECUTOR_OP_EXIT 0
+#define EXECUTOR_OP_TASK 1
+#define MAX_TASK_ATTEMPTS 3
+
+typedef struct Executor {
+	pid_t pid; // 0 when not running
+	FILE *in;  // results from the executor
+	FILE *out; // tasks to the executor
+} Executor;
+
+typedef struct ExecutorPool {
+	Executor *executors;
+	int num_executors;
+	Serializer ser;
+	Deserializer des;
+	RDD *root; // DAG of the current execute()
+	// jobs take turns, see executors_next; both under the pool mutex
+	struct Job *owner; // the job the executors were forked for
+	struct Job *waiting, *waiting_tail; // submitted jobs queued behind it, linked by next
+} ExecutorPool;
+
+struct ExecutorPool *executor_pool; // NULL unless started with MS_RunExecutors
+
+/* A Deal crosses the executor sockets as int32 n, int64 size, then per sublist
+ * the user records in the write_partition format, an empty list for NULL */
+void *deal_serialize(void *elem, size_t *len)
+{
+	Deal *deal = elem;
+	char *buf = NULL;
+	FILE *fp = open_memstream(&buf, len);
+	if (fp == NULL) {
+		return NULL;
+	}
+	int32_t n = deal->n;
+	int64_t size = deal->size;
+	int ret = fwrite(&n, sizeof(n), 1, fp) == 1 && fwrite(&size, sizeof(size), 1, fp) == 1 ? 0 : -1;
+	List *empty = list_init(1);
+	for (int r = 0; r < deal->n && ret == 0; r++) {
+		ret = write_partition(fp, deal->sub[r] ? deal->sub[r] : empty, executor_pool->ser);
+	}
+	list_free(empty);
+	if (fclose(fp) != 0 || ret != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+void *deal_deserialize(void *buf, size_t len)
+{
+	FILE *fp = fmemopen(buf, len, "r");
+	if (fp == NULL) {
+		return NULL;
+	}
+	int32_t n;
+	int64_t size;
+	if (fread(&n, sizeof(n), 1, fp) != 1 || fread(&size, sizeof(size), 1, fp) != 1 || n <= 0) {
+		fclose(fp);
+		return NULL;
+	}
+	Deal *deal = deal_init(n, size);
+	for (int r = 0; r < n; r++) {
+		List *sub = read_partition(fp, executor_pool->des);
+		if (sub == NULL) {
+			deal_free(deal);
+			fclose(fp);
+			return NULL;
+		}
+		if (sub->size == 0) {
+			list_free(sub);
+		} else {
+			deal->sub[r] = sub;
+		}
+	}
+	fclose(fp);
+	return deal;
+}
+
+/* a forked executor only has the forking thread, so locks held by the driver's
+ * pool threads at fork time have to be reset before it touches the DAG */
+void reset_dag_locks(RDD *rdd)
+{
+	rdd->list_prot = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	rdd->partitions->linked_list_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	if (rdd->fn == semi_join_records) {
+		((BloomSpec *)rdd->ctx)->mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	}
+	for (int i = 0; i < rdd->numdependencies; i++) {
+		reset_dag_locks(rdd->dependencies[i]);
+	}
+}
+
+/* runs inside the executor process until the driver says to exit */
+void executor_main(FILE *in, FILE *out)
+{
+	reset_dag_locks(executor_pool->root);
+
+	uint32_t op;
+	while (fread(&op, sizeof(op), 1, in) == 1 && op == EXECUTOR_OP_TASK) {
+		uint64_t addr;
+		int32_t pnum;
+		uint32_t ninputs;
+		if (fread(&addr, sizeof(addr), 1, in) != 1 || fread(&pnum, sizeof(pnum), 1, in) != 1 ||
+			fread(&ninputs, sizeof(ninputs), 1, in) != 1) {
+			_exit(1);
+		}
+		RDD *rdd = (RDD *)(uintptr_t)addr;
+
+		// install the input partitions the driver materialized after we were forked
+		for (uint32_t i = 0; i < ninputs; i++) {
+			uint64_t depaddr;
+			int32_t dpnum;
+			if (fread(&depaddr, sizeof(depaddr), 1, in) != 1 || fread(&dpnum, sizeof(dpnum), 1, in) != 1) {
+				_exit(1);
+			}
+			RDD *dep = (RDD *)(uintptr_t)depaddr;
+			List *part = read_partition(in, partition_deserializer(dep, executor_pool->des));
+			if (part == NULL) {
+				_exit(1);
+			}
+			set_nth_element(dep->partitions, dpnum, part);
+		}
+
+		RDD *dep = rdd->dependencies[0];
+		if ((rdd->trans == MAP || rdd->trans == FILTER) && dep->trans == MAP && dep->fn == identity) {
+			rewind(get_nth_element(dep->partitions, pnum)); // a crashed executor may have read part of it
+		}
+		if (rdd->trans != PARTITIONBY) {
+			set_nth_element(rdd->partitions, pnum, NULL);
+		}
+
+		Task task = { .rdd = rdd, .pnum = pnum, .metric = NULL };
+		iter_list(&task);
+
+		int first = rdd->trans == PARTITIONBY ? 0 : pnum;
+		int last = rdd->trans == PARTITIONBY ? rdd->numpartitions : pnum + 1;
+		uint32_t nparts = last - first;
+		fwrite(&nparts, sizeof(nparts), 1, out);
+		for (int32_t i = first; i < last; i++) {
+			fwrite(&i, sizeof(i), 1, out);
+			if (write_partition(out, get_nth_element(rdd->partitions, i),
+								partition_serializer(rdd, executor_pool->ser)) != 0) {
+				_exit(1);
+			}
+		}
+		if (fflush(out) != 0) {
+			_exit(1);
+		}
+	}
+	_exit(0);
+}
+
+/* in a new executor, closes the driver's ends of the other executors' sockets */
+void close_other_executors(Executor *e)
+{
+	for (int i = 0; i < executor_pool->num_executors; i++) {
+		Executor *other = &executor_pool->executors[i];
+		if (other->pid != 0 && other != e) {
+			close(fileno(other->in));
+			close(fileno(other->out));
+		}
+	}
+}
+
+/* Forks a fresh executor connected to the driver through a socketpair(), so
+ * nothing else can connect to it. */
+int executor_spawn(Executor *e)
+{
+	int fds[2]; // driver end, executor end
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror("socketpair");
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		close_other_executors(e);
+		close(fds[0]);
+		executor_main(fdopen(fds[1], "r"), fdopen(dup(fds[1]), "w"));
+	}
+
+	close(fds[1]);
+	e->pid = pid;
+	e->in = fdopen(fds[0], "r");
+	e->out = fdopen(dup(fds[0]), "w");
+	return 0;
+}
+
+void executor_kill(Executor *e)
+{
+	kill(e->pid, SIGKILL);
+	fclose(e->in);
+	fclose(e->out);
+	waitpid(e->pid, NULL, 0);
+	e->pid = 0;
+}
+
+/* Sends input partition pnum of dep. A repartition() task only gets the one
+ * sublist of each Deal it takes records from; `offset` counts the records of
+ * the Deals sent before, see gather_records. */
+int send_input(FILE *out, RDD *dep, int pnum, int task_pnum, long *offset)
+{
+	uint64_t depaddr = (uintptr_t)dep;
+	int32_t dpnum = pnum;
+	pthread_mutex_lock(&dep->list_prot);
+	List *part = get_nth_element(dep->partitions, pnum);
+	pthread_mutex_unlock(&dep->list_prot);
+
+	if (fwrite(&depaddr, sizeof(depaddr), 1, out) != 1 || fwrite(&dpnum, sizeof(dpnum), 1, out) != 1) {
+		return -1;
+	}
+	if (dep->fn != deal_records) {
+		return write_partition(out, part, executor_pool->ser);
+	}
+
+	Deal *deal = part->head->ptr;
+	Deal *slice = deal_init(deal->n, deal->size);
+	int r = deal_slot(task_pnum, *offset, deal->n);
+	slice->sub[r] = deal->sub[r];
+	*offset += deal->size;
+
+	List *view = list_init(1);
+	list_add_elem(view, slice);
+	int ret = write_partition(out, view, deal_serialize);
+	list_free(view);
+	free(slice);
+	return ret;
+}
+
+int send_task(Executor *e, Task *task)
+{
+	RDD *rdd = task->rdd;
+	uint32_t op = EXECUTOR_OP_TASK;
+	uint64_t addr = (uintptr_t)rdd;
+	int32_t pnum = task->pnum;
+	uint32_t ninputs = 0;
+	int first[MAXDEPS], last[MAXDEPS];
+
+	for (int d = 0; d < rdd->numdependencies; d++) {
+		RDD *dep = rdd->dependencies[d];
+		input_range(rdd, d, task->pnum, task->pnum + 1, &first[d], &last[d]);
+		if (dep->trans == MAP && dep->fn == identity) { // executors read files themselves
+			last[d] = first[d];
+		}
+		ninputs += last[d] - first[d];
+	}
+
+	if (fwrite(&op, sizeof(op), 1, e->out) != 1 || fwrite(&addr, sizeof(addr), 1, e->out) != 1 ||
+		fwrite(&pnum, sizeof(pnum), 1, e->out) != 1 || fwrite(&ninputs, sizeof(ninputs), 1, e->out) != 1) {
+		return -1;
+	}
+
+	long offset = 0;
+	for (int d = 0; d < rdd->numdependencies; d++) {
+		for (int i = first[d]; i < last[d]; i++) {
+			if (send_input(e->out, rdd->dependencies[d], i, task->pnum, &offset) != 0) {
+				return -1;
+			}
+		}
+	}
+	return fflush(e->out) == 0 ? 0 : -1;
+}
+
+/* reads every output partition before installing any, so a crash mid-reply leaves no trace */
+int receive_result(Executor *e, Task *task)
+{
+	uint32_t nparts;
+	if (fread(&nparts, sizeof(nparts), 1, e->in) != 1) {
+		return -1;
+	}
+
+	List **parts = calloc(nparts, sizeof(List *));
+	int32_t *pnums = calloc(nparts, sizeof(int32_t));
+	int ret = 0;
+	for (uint32_t i = 0; i < nparts && ret == 0; i++) {
+		if (fread(&pnums[i], sizeof(int32_t), 1, e->in) != 1 ||
+			(parts[i] = read_partition(e->in, partition_deserializer(task->rdd, executor_pool->des))) == NULL) {
+			ret = -1;
+		}
+	}
+
+	if (ret == 0 && task->rdd->trans == PARTITIONBY) {
+		for (uint32_t i = 0; i < nparts; i++) {
+			set_nth_element(task->rdd->partitions, pnums[i], parts[i]);
+		}
+		mark_materialized(task->rdd, task->pnum);
+	} else if (ret == 0) {
+		publish_partition(task->rdd, pnums[0], parts[0]);
+	}
+	free(parts);
+	free(pnums);
+	return ret;
+}
+
+/* Fails the job of a task that can't be run, so that its job_wait returns an
+ * error instead of waiting for the partition forever. Another job may still
+ * queue the partition again. */
+void fail_task(Task *task)
+{
+	RDD *rdd = task->rdd;
+	pthread_mutex_lock(&threads->mutex);
+	((TaskState *)task)->job->failed = 1;
+	if (rdd->trans == PARTITIONBY) {
+		for (int i = 0; i < rdd->partitions->capacity; i++) {
+			rdd->addedtoqueue[i] = 0;
+		}
+	} else {
+		rdd->addedtoqueue[task->pnum] = 0;
+	}
+	pthread_mutex_unlock(&threads->mutex);
+}
+
+/* executor-mode counterpart of iter_list, called by the pool thread owning executor `id` */
+void run_remote(Task *task, int id)
+{
+	Executor *e = &executor_pool->executors[id];
+	for (int attempt = 0; attempt < MAX_TASK_ATTEMPTS; attempt++) {
+		if (e->pid == 0 && executor_spawn(e) != 0) {
+			continue;
+		}
+		if (send_task(e, task) == 0 && receive_result(e, task) == 0) {
+			return;
+		}
+		printf("Executor %d (pid %d) failed on RDD %p part %d, restarting it\n", id, e->pid, task->rdd, task->pnum);
+		executor_kill(e);
+	}
+	printf("Task RDD %p part %d failed %d times, giving up\n", task->rdd, task->pnum, MAX_TASK_ATTEMPTS);
+	fail_task(task);
+}
+
+void executors_start(RDD *root)
+{
+	executor_pool->root = root;
+	for (int i = 0; i < executor_pool->num_executors; i++) {
+		if (executor_spawn(&executor_pool->executors[i]) != 0) {
+			printf("Could not start executor %d\n", i);
+			exit(1);
+		}
+	}
+}
+
+void executors_stop()
+{
+	uint32_t op = EXECUTOR_OP_EXIT;
+	for (int i = 0; i < executor_pool->num_executors; i++) {
+		Executor *e = &executor_pool->executors[i];
+		if (e->pid == 0) {
+			continue;
+		}
+		fwrite(&op, sizeof(op), 1, e->out);
+		fclose(e->out);
+		fclose(e->in);
+		waitpid(e->pid, NULL, 0);
+		e->pid = 0;
+	}
+}
+
+Task* pop_queue(Queue *queue) // we are assuming we hold the pool mutex
+{
+	if (queue->head == NULL) {
+		return NULL;
 	}
-	return NULL;
+	Node *node = queue->head;
+	if (queue->head == queue->tail) {
+		queue->tail = NULL;
+	}
+	queue->head = queue->head->next;
+	Task *task = node->task;
+	free(node);
+	threads->queued--;
+	return task;
 }
 
-void metric_queue_init() {
-    metric_queue = malloc(sizeof(MetricQueue));
-	metric_queue->status = 1;
-	metric_queue->fp = fopen("metrics.log", "w");
-	if (metric_queue->fp == NULL) {
-		printf("fopen");
-		exit(-1);
+/* pops a task of the job with the lowest running/weight share, holding the pool mutex */
+Task *pick_task()
+{
+	Job *best = NULL;
+	Job *best_prev = NULL;
+	for (Job *prev = NULL, *job = threads->jobs; job; prev = job, job = job->next) {
+		if (job->queue.head == NULL) {
+			continue;
+		}
+		if (best == NULL || (long)job->running * best->weight < (long)best->running * job->weight) {
+			best = job;
+			best_prev = prev;
+		}
 	}
-    metric_queue->head = metric_queue->tail = NULL;
-    pthread_mutex_init(&metric_queue->mutex, NULL);
-    pthread_cond_init(&metric_queue->cond, NULL);
-	if (pthread_create(&metric_queue->thread, NULL, metric_thread_function, NULL) != 0) {
-		printf("pthread_create");
-		exit(-1);
+	if (best == NULL) {
+		return NULL;
+	}
+
+	// move it to the back so jobs with equal shares take turns
+	if (best->next) {
+		if (best_prev) {
+			best_prev->next = best->next;
+		} else {
+			threads->jobs = best->next;
+		}
+		Job *last = best->next;
+		while (last->next) {
+			last = last->next;
+		}
+		last->next = best;
+		best->next = NULL;
 	}
+
+	best->running++;
+	return pop_queue(&best->queue);
 }
 
-void metric_queue_add(TaskMetric* taskmetric) {
-	pthread_mutex_lock(&metric_queue->mutex);
-	MetricNode* temp = malloc(sizeof(MetricNode));
-	temp->metric = taskmetric;
-	temp->next = NULL;
-	MetricNode* tail = metric_queue->tail;
-	if (tail == NULL) {
-		metric_queue->head = temp;
-		metric_queue->tail = temp;
-	} else {
-		metric_queue->tail->next = temp;
-		metric_queue->tail = temp;
+void job_free(Job *job)
+{
+	while (job->queue.head) { // leftover speculative copies
+		Task *task = pop_queue(&job->queue);
+		free(task->metric);
+		free(task);
 	}
-	pthread_cond_signal(&metric_queue->cond);
-	pthread_mutex_unlock(&metric_queue->mutex);
+	pthread_cond_destroy(&job->done_cond);
+	free(job);
 }
 
-void metric_queue_clean() {
-	pthread_mutex_lock(&metric_queue->mutex);
-	metric_queue->status = 0;
-	pthread_cond_signal(&metric_queue->cond);
-	pthread_mutex_unlock(&metric_queue->mutex);
+void reschedule_jobs(); // defined with the scheduler below
+void executors_next();
+void adapt_pool();
 
-	pthread_join(metric_queue->thread, NULL);
-	fclose(metric_queue->fp);
-	pthread_mutex_destroy(&metric_queue->mutex);
-	pthread_cond_destroy(&metric_queue->cond);
-	MetricNode *current = metric_queue->head;
-	while (current != NULL) {
-		MetricNode *temp = current;
-		current = current->next;
-		free(temp->metric);
-		free(temp);
+/* CPU time of a pool thread so far */
+long thread_cpu_nanos(pthread_t thread)
+{
+	clockid_t cid;
+	struct timespec ts;
+	if (pthread_getcpuclockid(thread, &cid) != 0 || clock_gettime(cid, &ts) != 0) {
+		return 0;
 	}
-	free(metric_queue);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
 }
 
-Task* pop_queue() // this function will only be called from thread_function, we are assuming we hold the mutex
+void record_finished(TaskState *state, long duration)
 {
-	if (threads->work_queue->head == NULL) {
-		return NULL;
+	pthread_mutex_lock(&threads->status_mutex);
+	if (threads->num_finished == threads->finished_capacity) {
+		threads->finished_capacity *= 2;
+		threads->finished = realloc(threads->finished, threads->finished_capacity * sizeof(FinishedTask));
 	}
-	Node *job = threads->work_queue->head;
-	if (threads->work_queue->head == threads->work_queue->tail) {
-		threads->work_queue->tail = NULL;
+	FinishedTask *finished = &threads->finished[threads->num_finished];
+	finished->rdd = state->task.rdd;
+	finished->job = state->job->id;
+	finished->split = state->split != NULL;
+	finished->duration = duration;
+	finished->profile = state->profile;
+	threads->num_finished++;
+	pthread_mutex_unlock(&threads->status_mutex);
+}
+
+/* drops the finished tasks of a retired job, so the history only covers running jobs */
+void forget_finished(long job)
+{
+	pthread_mutex_lock(&threads->status_mutex);
+	int kept = 0;
+	for (int i = 0; i < threads->num_finished; i++) {
+		if (threads->finished[i].job != job) {
+			threads->finished[kept++] = threads->finished[i];
+		}
 	}
-	threads->work_queue->head = threads->work_queue->head->next;
-	return job->task;
+	threads->num_finished = kept;
+	pthread_mutex_unlock(&threads->status_mutex);
 }
 
 void *thread_function(void *arg) { // jump
     long thread_id = (long)arg;
-    
+
+    pthread_mutex_lock(&threads->mutex);
     while (1) {
-        pthread_mutex_lock(&threads->work_queue->mutex);
-        
+        // check for termination signal
+        if (threads->thread_status[thread_id] == -1) {
+            break;
+        }
+		if (thread_id >= threads->num_threads) { // the pool shrank, see adapt_pool
+			pthread_mutex_lock(&threads->status_mutex);
+			threads->thread_status[thread_id] = -2;
+			pthread_mutex_unlock(&threads->status_mutex);
+			break;
+		}
+
         // wait for work
-        while (threads->work_queue->head == NULL) {
-			if (threads->active_count == 0) {
-				pthread_cond_signal(&threads->main_cond);
-			}
-            pthread_cond_wait(&threads->work_queue->cond, &threads->work_queue->mutex);
-            
-            // check for termination signal
-            if (threads->thread_status[thread_id] == -1) {
-                pthread_mutex_unlock(&threads->work_queue->mutex);
-                pthread_exit(NULL);
-            }
+        Task *task = pick_task();
+        if (task == NULL) {
+            pthread_cond_wait(&threads->work_cond, &threads->mutex);
+            continue;
         }
 
-		Task *task = pop_queue();
+		TaskState *state = (TaskState *)task;
 		// update status to working
+		threads->active_count++;
 		pthread_mutex_lock(&threads->status_mutex);
 		threads->thread_status[thread_id] = 1;
-		threads->active_count++;
+		threads->running[thread_id] = state;
+		clock_gettime(CLOCK_MONOTONIC, &state->started);
 		pthread_mutex_unlock(&threads->status_mutex);
-		pthread_mutex_unlock(&threads->work_queue->mutex);
+		TaskClock *tc = &threads->clocks[thread_id];
+		tc->busy = 1;
+		tc->since = state->started;
+		tc->cpu_since = thread_cpu_nanos(pthread_self());
+		pthread_mutex_unlock(&threads->mutex);
+
+		struct rusage usage_start, usage_end;
+		getrusage(RUSAGE_THREAD, &usage_start);
+
+		if (state->copy && task->rdd->ismaterialized[task->pnum]) {
+			// the original finished while this copy was queued
+		} else {
+			prof = &state->profile;
+			if (state->split) {
+				run_chunk(state);
+			} else if (executor_pool) {
+				run_remote(task, thread_id);
+			} else {
+				iter_list(task);
+			}
 
-		if (task) {
-            iter_list(task);
-            
             // update metrics
             struct timespec end_time;
             clock_gettime(CLOCK_MONOTONIC, &end_time);
             task->metric->duration = TIME_DIFF_MICROS(task->metric->scheduled, end_time);
-            metric_queue_add(task->metric);
+			PROFILE_ADD(tasks, 1);
+			PROFILE_ADD(run_nanos, TIME_DIFF_NANOS(state->started, end_time));
+			PROFILE_ADD(queue_nanos, TIME_DIFF_NANOS(task->metric->scheduled, state->started));
+			prof = &unattributed_profile;
+            metric_queue_add(task->metric); // the metric thread frees it from here on
 			pthread_cond_signal(&metric_queue->cond);
+
+			record_finished(state, TIME_DIFF_MICROS(state->started, end_time));
         }
-		pthread_cond_signal(&threads->main_cond);
+		getrusage(RUSAGE_THREAD, &usage_end);
 
 		// update status to ready
 		pthread_mutex_lock(&threads->status_mutex);
 		threads->thread_status[thread_id] = 0;
-		threads->active_count--;
+		threads->running[thread_id] = NULL;
 		pthread_mutex_unlock(&threads->status_mutex);
+
+		pthread_mutex_lock(&threads->mutex);
+		threads->active_count--;
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long cpu_now = thread_cpu_nanos(pthread_self());
+		threads->window_task_nanos += TIME_DIFF_NANOS(tc->since, now);
+		threads->window_cpu_nanos += cpu_now - tc->cpu_since;
+		tc->busy = 0;
+		threads->window_voluntary += usage_end.ru_nvcsw - usage_start.ru_nvcsw;
+		threads->window_involuntary += usage_end.ru_nivcsw - usage_start.ru_nivcsw;
+		Job *job = state->job;
+		job->running--;
+		reschedule_jobs();
+		if (job->done && job->running == 0) { // job_wait may be waiting for losing copies
+			pthread_cond_broadcast(&job->done_cond);
+		}
+		if (executor_pool) {
+			executors_next();
+		}
+		adapt_pool();
+		pthread_cond_broadcast(&threads->main_cond);
 	}
+	pthread_mutex_unlock(&threads->mutex);
 	return NULL;
 }
 
-/* Create the pool with numthreads threads. Do any necessary allocations. */
-void thread_pool_init(int num_threads) {
-    threads = malloc(sizeof(ThreadPool));
-    threads->work_queue = malloc(sizeof(Queue));
-    pthread_mutex_init(&threads->work_queue->mutex, NULL);
-    pthread_cond_init(&threads->work_queue->cond, NULL);
-    threads->work_queue->head = threads->work_queue->tail = NULL;
+/* starts workers in the slots [from, to), joining the retired ones first; holding the pool mutex */
+void start_workers(int from, int to)
+{
+	for (int i = from; i < to; i++) {
+		int status = threads->thread_status[i];
+		if (status >= 0) { // still around, it will notice it is no longer retiring
+			continue;
+		}
+		if (status == -2) {
+			pthread_join(threads->threads[i], NULL);
+		}
+		threads->thread_status[i] = 0;
+		if (pthread_create(&threads->threads[i], NULL, thread_function, (void*)(long)i) != 0) {
+			printf("pthread_create");
+			exit(-1);
+		}
+	}
+}
 
-    threads->threads = malloc(num_threads * sizeof(pthread_t));
-    threads->thread_status = calloc(num_threads, sizeof(int));
+/* Create the pool with min_threads threads, which adapt_pool may grow up to
+ * max_threads. Do any necessary allocations. */
+void thread_pool_init(int min_threads, int max_threads, int cores) {
+    threads = malloc(sizeof(ThreadPool));
+    threads->jobs = NULL;
+    pthread_mutex_init(&threads->mutex, NULL);
+    pthread_cond_init(&threads->work_cond, NULL);
+
+    threads->threads = malloc(max_threads * sizeof(pthread_t));
+    threads->thread_status = malloc(max_threads * sizeof(int));
+    for (int i = 0; i < max_threads; i++) {
+        threads->thread_status[i] = -3;
+    }
     pthread_mutex_init(&threads->status_mutex, NULL);
 	pthread_cond_init(&threads->main_cond, NULL);
-    threads->num_threads = num_threads;
+    threads->num_threads = min_threads;
+    threads->min_threads = min_threads;
+    threads->max_threads = max_threads;
+    threads->cores = cores;
     threads->active_count = 0;
+    threads->queued = 0;
+    threads->running = calloc(max_threads, sizeof(TaskState *));
+    threads->clocks = calloc(max_threads, sizeof(TaskClock));
+    threads->finished_capacity = 64;
+    threads->finished = malloc(threads->finished_capacity * sizeof(FinishedTask));
+    threads->num_finished = 0;
+    threads->num_jobs = 0;
+    clock_gettime(CLOCK_MONOTONIC, &threads->window_start);
+    threads->window_task_nanos = threads->window_cpu_nanos = 0;
+    threads->window_voluntary = threads->window_involuntary = 0;
+    threads->total_task_nanos = threads->thread_nanos = 0;
+    threads->resizes = 0;
+    threads->smallest = threads->largest = min_threads;
+
+    pthread_mutex_lock(&threads->mutex);
+    start_workers(0, min_threads);
+    pthread_mutex_unlock(&threads->mutex);
+}
 
-    for (int i = 0; i < num_threads; i++) {
-        if (pthread_create(&threads->threads[i], NULL, thread_function, (void*)(long)i) != 0) {
-			printf("pthread_create");
-            exit(-1);
-        }
-    }
+/* Pool sizing. Once per interval, the task time of the workers is split into
+ * running on a CPU, blocked (voluntary context switches: file reads, locks,
+ * ...) and preempted (involuntary ones: more runnable threads than CPUs,
+ * whether ours or other processes'). Tasks still running count with their
+ * time so far; their context switches are only known once they end, so their
+ * time off a CPU counts as blocked while the cores were mostly idle. With
+ * tasks queued, a mostly preempted pool loses a thread; otherwise it is sized
+ * to keep every core busy, which takes cores * (CPU + blocked time) / CPU time
+ * threads, but no more than there are tasks. With nothing queued it shrinks to
+ * the threads that were busy. */
+#define POOL_THREADS_PER_CORE 4 // default upper bound of MS_Run
+#define POOL_INTERVAL_MICROS 100000
+#define POOL_PREEMPTED_SHARE 4 // shrink if more than 1/4 of the task time was preempted
+
+/* called holding the pool mutex, after every task and while jobs are waited on */
+void adapt_pool()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed = TIME_DIFF_NANOS(threads->window_start, now);
+	if (elapsed < POOL_INTERVAL_MICROS * 1000L) {
+		return;
+	}
+
+	long running = 0, running_cpu = 0;
+	for (int i = 0; i < threads->max_threads; i++) {
+		TaskClock *tc = &threads->clocks[i];
+		if (tc->busy) {
+			long cpu_now = thread_cpu_nanos(threads->threads[i]);
+			running += TIME_DIFF_NANOS(tc->since, now);
+			running_cpu += cpu_now - tc->cpu_since;
+			tc->since = now;
+			tc->cpu_since = cpu_now;
+		}
+	}
+
+	long finished = threads->window_task_nanos;
+	long finished_cpu = threads->window_cpu_nanos < finished ? threads->window_cpu_nanos : finished;
+	running_cpu = running_cpu < running ? running_cpu : running;
+	long task = finished + running;
+	long cpu = finished_cpu + running_cpu;
+	long switches = threads->window_voluntary + threads->window_involuntary;
+	long blocked = switches > 0 ? (finished - finished_cpu) * threads->window_voluntary / switches : 0;
+	if (cpu * 2 < threads->cores * elapsed) {
+		blocked += running - running_cpu;
+	}
+	long preempted = task - cpu - blocked;
+	int size = threads->num_threads;
+	int target = size;
+
+	if (threads->queued > 0 && preempted * POOL_PREEMPTED_SHARE > task) {
+		target = size - 1;
+	} else if (threads->queued > 0 && (cpu > 0 || blocked > 0)) {
+		target = cpu > 0 ? (threads->cores * (cpu + blocked) + cpu / 2) / cpu : threads->active_count + threads->queued;
+		if (target > threads->active_count + threads->queued) {
+			target = threads->active_count + threads->queued;
+		}
+	} else if (threads->queued == 0 && task * 2 < size * elapsed) {
+		target = threads->active_count;
+	}
+	if (target < threads->min_threads) {
+		target = threads->min_threads;
+	}
+	if (target > threads->max_threads) {
+		target = threads->max_threads;
+	}
+
+	if (target != size) {
+		long utilization = task * 100 / (size * elapsed);
+		if (metric_queue) {
+			fprintf(metric_queue->fp, "Pool resize %d -> %d threads -- queued %d, utilization %ld%%, "
+					"task time: running %ld%% blocked %ld%% preempted %ld%%\n",
+					size, target, threads->queued, utilization < 100 ? utilization : 100,
+					task ? cpu * 100 / task : 0, task ? blocked * 100 / task : 0, task ? preempted * 100 / task : 0);
+		}
+		threads->num_threads = target;
+		threads->resizes++;
+		threads->smallest = target < threads->smallest ? target : threads->smallest;
+		threads->largest = target > threads->largest ? target : threads->largest;
+		if (target > size) {
+			start_workers(size, target);
+		} else {
+			pthread_cond_broadcast(&threads->work_cond); // idle workers above target retire
+		}
+	}
+
+	threads->total_task_nanos += task;
+	threads->thread_nanos += size * elapsed;
+	threads->window_start = now;
+	threads->window_task_nanos = threads->window_cpu_nanos = 0;
+	threads->window_voluntary = threads->window_involuntary = 0;
 }
 
 /* Join all the threads and deallocate any memory used by the pool. */
 void thread_pool_destroy() {
-    // signal all threads to terminate
-    pthread_mutex_lock(&threads->status_mutex);
-    for (int i = 0; i < threads->num_threads; i++) {
-        threads->thread_status[i] = -1;
+    // signal all threads to terminate and wake them up
+    pthread_mutex_lock(&threads->mutex);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    threads->total_task_nanos += threads->window_task_nanos;
+    threads->thread_nanos += threads->num_threads * TIME_DIFF_NANOS(threads->window_start, now);
+    for (int i = 0; i < threads->max_threads; i++) {
+        if (threads->thread_status[i] >= 0) {
+            threads->thread_status[i] = -1;
+        }
     }
-	pthread_mutex_unlock(&threads->status_mutex);
-    
-    // wake all threads
-    pthread_cond_broadcast(&threads->work_queue->cond);
-    
+    pthread_cond_broadcast(&threads->work_cond);
+    pthread_mutex_unlock(&threads->mutex);
+
     // join all threads
-    for (int i = 0; i < threads->num_threads; i++) {
-        pthread_join(threads->threads[i], NULL);
+    for (int i = 0; i < threads->max_threads; i++) {
+        if (threads->thread_status[i] != -3) {
+            pthread_join(threads->threads[i], NULL);
+        }
+    }
+
+    if (metric_queue) {
+        fprintf(metric_queue->fp, "Pool -- %d resizes, %d to %d threads (bounds %d to %d), utilization %ld%%\n",
+                threads->resizes, threads->smallest, threads->largest, threads->min_threads, threads->max_threads,
+                threads->thread_nanos > 0 ? threads->total_task_nanos * 100 / threads->thread_nanos : 0);
     }
     
     // cleanup
-    pthread_mutex_destroy(&threads->work_queue->mutex);
-    pthread_cond_destroy(&threads->work_queue->cond);
+    pthread_mutex_destroy(&threads->mutex);
+    pthread_cond_destroy(&threads->work_cond);
     pthread_mutex_destroy(&threads->status_mutex);
 	pthread_cond_destroy(&threads->main_cond);
     free(threads->threads);
     free(threads->thread_status);
-    free(threads->work_queue);
+    free(threads->running);
+    free(threads->clocks);
+    free(threads->finished);
     free(threads);
 }
 
-/* Returns when the work queue is empty and all threads have finished their tasks. */
+/* Returns when every job is done and all threads have finished their tasks. */
 void thread_pool_wait()
 {
-	while (threads->work_queue->head != NULL) { } // wait for the queue to be empty
-	// queue is now empty, must wait for all threads to finish their jobs
-	while (threads->active_count > 0) { }
-	return;
+	pthread_mutex_lock(&threads->mutex);
+	while (threads->jobs != NULL || threads->active_count > 0) {
+		pthread_cond_wait(&threads->main_cond, &threads->mutex);
+	}
+	pthread_mutex_unlock(&threads->mutex);
 }
 
-/* Adds a task to the work queue. */
-void thread_pool_submit(Task *task)
+/* Adds a task to the job's queue, holding the pool mutex. */
+void thread_pool_submit(Job *job, Task *task)
 {
+	((TaskState *)task)->job = job;
+	threads->queued++;
 	Node *temp = malloc(sizeof(Node));
 	temp->task = task;
 	temp->next = NULL;
-	Node *tail = threads->work_queue->tail;
+	Node *tail = job->queue.tail;
 	if (tail == NULL) {
-		threads->work_queue->head = temp;
-		threads->work_queue->tail = temp;
+		job->queue.head = temp;
+		job->queue.tail = temp;
 	} else {
-		threads->work_queue->tail->next = temp;
-		threads->work_queue->tail = temp;
+		job->queue.tail->next = temp;
+		job->queue.tail = temp;
 	}
 
-	pthread_cond_signal(&threads->work_queue->cond);
+	pthread_cond_signal(&threads->work_cond);
 	return;
 }
 
@@ -678,6 +2204,112 @@ RDD *join(RDD *dep1, RDD *dep2, Joiner fn, void *ctx)
 	return rdd;
 }
 
+/* shared by coalesce() and repartition(), which only differ in their marker */
+RDD *rebalance(RDD *dep, void *fn, int numpartitions)
+{
+	if (dep->numdependencies == 0 && dep->fn == identity) {
+		printf("Cannot rebalance an RDD read directly from files, map it first\n");
+		return NULL;
+	}
+	if (numpartitions <= 0) {
+		printf("Invalid number of partitions\n");
+		return NULL;
+	}
+
+	RDD *rdd = create_rdd(1, MAP, fn, dep);
+	rdd->partitions = list_init(numpartitions);
+	rdd->numpartitions = numpartitions;
+	free(rdd->ismaterialized);
+	rdd->ismaterialized = calloc(numpartitions, sizeof(int));
+	if (rdd->ismaterialized == NULL) {
+		printf("malloc error\n");
+		exit(1);
+	}
+	free(rdd->addedtoqueue);
+	rdd->addedtoqueue = calloc(numpartitions, sizeof(int));
+	if (rdd->addedtoqueue == NULL) {
+		printf("malloc error\n");
+		exit(1);
+	}
+	return rdd;
+}
+
+/* Merges the partitions of dep into numpartitions partitions of contiguous
+ * input partitions, without moving records around. Like in Spark, it can only
+ * lower the partition count; use repartition() to raise it. */
+RDD *coalesce(RDD *dep, int numpartitions)
+{
+	if (numpartitions > dep->partitions->capacity) {
+		numpartitions = dep->partitions->capacity;
+	}
+	return rebalance(dep, coalesce_partitions, numpartitions);
+}
+
+/* Spreads the records of dep evenly over numpartitions partitions. */
+RDD *repartition(RDD *dep, int numpartitions)
+{
+	if (numpartitions <= 0 || (dep->numdependencies == 0 && dep->fn == identity)) {
+		return rebalance(dep, repartition_records, numpartitions); // reports the error
+	}
+
+	// each input partition is dealt out in its own task, see gather_records
+	RDD *dealt = map(dep, deal_records);
+	int *n = malloc(sizeof(int));
+	*n = numpartitions;
+	dealt->ctx = n;
+	return rebalance(dealt, repartition_records, numpartitions);
+}
+
+/* Keeps each record of dep with probability `fraction`. The draw is seeded
+ * by (seed, partition, position), so the same seed picks the same records. */
+RDD *sample(RDD *dep, double fraction, unsigned long seed)
+{
+	if (dep->numdependencies == 0 && dep->fn == identity) {
+		printf("Cannot sample an RDD read directly from files, map it first\n");
+		return NULL;
+	}
+	if (fraction < 0 || fraction > 1) {
+		printf("Sample fraction must be between 0 and 1\n");
+		return NULL;
+	}
+
+	SampleSpec *spec = malloc(sizeof(SampleSpec));
+	spec->fraction = fraction;
+	spec->seed = mix64(seed);
+	return filter(dep, sample_records, spec);
+}
+
+/* Semi-join pruning: keeps the records of `large` whose join key (largekey)
+ * may occur among the join keys (smallkey) of `small`, using a bloom filter
+ * with false positive rate fpp. Put it in front of the partitionBy of the
+ * large side of a join whose other side is small or selective, so records
+ * that can't match are neither shuffled nor compared. `small` is fully
+ * materialized before any of this RDD's partitions. */
+RDD *semiJoinFilter(RDD *large, RDD *small, Hasher largekey, Hasher smallkey, double fpp)
+{
+	if ((large->numdependencies == 0 && large->fn == identity) ||
+		(small->numdependencies == 0 && small->fn == identity)) {
+		printf("Cannot semi-join an RDD read directly from files, map it first\n");
+		return NULL;
+	}
+	if (fpp <= 0 || fpp >= 1) {
+		printf("Bloom filter false positive rate must be between 0 and 1\n");
+		return NULL;
+	}
+
+	BloomSpec *spec = calloc(1, sizeof(BloomSpec));
+	spec->fn = largekey;
+	spec->keyfn = smallkey;
+	spec->fpp = fpp;
+	spec->mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	spec->build = calloc(1, sizeof(Profile));
+
+	RDD *rdd = filter(large, semi_join_records, spec);
+	rdd->dependencies[1] = small;
+	rdd->numdependencies = 2;
+	return rdd;
+}
+
 /* Special RDD constructor.
  * By convention, this is how we read from input files. */
 RDD *RDDFromFiles(char **filenames, int numfiles)
@@ -705,47 +2337,252 @@ RDD *RDDFromFiles(char **filenames, int numfiles)
 		exit(1);
 	}
 
-	for (int i = 0; i < numfiles; i++) {
-		rdd->ismaterialized[i] = 1; // all partitions are materialized
+	for (int i = 0; i < numfiles; i++) {
+		rdd->ismaterialized[i] = 1; // all partitions are materialized
+	}
+
+	rdd->addedtoqueue = calloc(numfiles, sizeof(int));
+	if (rdd->addedtoqueue == NULL) {
+		printf("malloc error\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < numfiles; i++) {
+		rdd->addedtoqueue[i] = 1; // all partitions are not added to queue
+	}
+
+	rdd->fullymaterialized = 1;
+
+	return rdd;
+}
+
+#define CHECKPOINT_MAGIC "MSCK"
+
+/* Special RDD constructor.
+ * Rebuilds a fully materialized RDD from a directory written by checkpoint().
+ * Returns NULL if `dir` does not hold a complete checkpoint. */
+RDD *RDDFromCheckpoint(char *dir, Deserializer fn)
+{
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/manifest", dir);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	char magic[4];
+	uint32_t numpartitions;
+	if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, CHECKPOINT_MAGIC, 4) != 0 ||
+		fread(&numpartitions, sizeof(numpartitions), 1, fp) != 1 || numpartitions == 0 ||
+		numpartitions > INT_MAX) {
+		printf("Invalid checkpoint manifest\n");
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+
+	// the count isn't trusted until every part has been read, so grow as they load
+	List **parts = NULL;
+	uint32_t loaded = 0, capacity = 0;
+	for (; loaded < numpartitions; loaded++) {
+		snprintf(path, sizeof(path), "%s/part-%05u", dir, loaded);
+		fp = fopen(path, "r");
+		List *part = NULL;
+		if (fp != NULL) {
+			part = read_partition(fp, fn);
+			fclose(fp);
+		}
+		if (part == NULL) {
+			printf("Missing or corrupt checkpoint partition %s\n", path);
+			break;
+		}
+		if (loaded == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			parts = realloc(parts, capacity * sizeof(List *));
+		}
+		parts[loaded] = part;
+	}
+	if (loaded < numpartitions) {
+		for (uint32_t i = 0; i < loaded; i++) {
+			discard_partition(parts[i]);
+		}
+		free(parts);
+		return NULL;
+	}
+
+	RDD *rdd = malloc(sizeof(RDD));
+	rdd->partitions = list_init(numpartitions);
+	for (uint32_t i = 0; i < numpartitions; i++) {
+		list_add_elem(rdd->partitions, parts[i]);
+	}
+	free(parts);
+
+	rdd->numdependencies = 0;
+	rdd->numpartitions = numpartitions;
+	rdd->trans = MAP;
+	rdd->fn = NULL; // partitions are already Lists, not files (see identity)
+	rdd->ctx = NULL;
+	rdd->list_prot = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+
+	rdd->ismaterialized = calloc(numpartitions, sizeof(int));
+	rdd->addedtoqueue = calloc(numpartitions, sizeof(int));
+	if (rdd->ismaterialized == NULL || rdd->addedtoqueue == NULL) {
+		printf("malloc error\n");
+		exit(1);
+	}
+
+	for (uint32_t i = 0; i < numpartitions; i++) {
+		rdd->ismaterialized[i] = 1;
+		rdd->addedtoqueue[i] = 1;
+	}
+
+	rdd->fullymaterialized = 1;
+
+	return rdd;
+}
+
+/* NEW INFO UNLOCKED: each RDD should have a Task PER partition to be added into queue */
+Task *init_task(RDD *rdd, int pnum)
+{
+	TaskState *state = malloc(sizeof(TaskState));
+	state->split = NULL;
+	state->speculated = 0;
+	state->copy = 0;
+	memset(&state->profile, 0, sizeof(Profile));
+	Task *task = &state->task;
+	task->rdd = rdd;
+	task->pnum = pnum;
+	task->metric = malloc(sizeof(TaskMetric));
+	clock_gettime(CLOCK_MONOTONIC, &task->metric->created);
+	task->metric->rdd = rdd;
+	task->metric->pnum = pnum;
+	task->metric->duration = 0;
+	return task;
+}
+
+/* Skew handling: a MAP/FILTER/JOIN partition whose input costs more than
+ * SKEW_FACTOR times the median over the RDD's ready partitions is split into
+ * chunks (see Split). Cost is the number of input records, or the number of
+ * record pairs for JOIN, whose outer side is what gets chunked. */
+#define SKEW_FACTOR 4
+#define SKEW_MIN_COST 10000
+
+/* fills costs[i] for every partition of rdd whose input is materialized, -1 otherwise */
+void partition_costs(RDD *rdd, long *costs)
+{
+	RDD *dep1 = rdd->dependencies[0];
+	RDD *dep2 = rdd->trans == JOIN ? rdd->dependencies[1] : NULL;
+
+	pthread_mutex_lock(&dep1->list_prot);
+	if (dep2) {
+		pthread_mutex_lock(&dep2->list_prot);
+	}
+	LinkedListNode *part1 = dep1->partitions->head;
+	LinkedListNode *part2 = dep2 ? dep2->partitions->head : NULL;
+	for (int i = 0; i < rdd->partitions->capacity; i++) {
+		costs[i] = -1;
+		if (dep1->ismaterialized[i] && (!dep2 || dep2->ismaterialized[i])) {
+			costs[i] = ((List *)part1->ptr)->size;
+			if (dep2) {
+				costs[i] *= ((List *)part2->ptr)->size;
+			}
+		}
+		part1 = part1->next;
+		part2 = dep2 ? part2->next : NULL;
+	}
+	if (dep2) {
+		pthread_mutex_unlock(&dep2->list_prot);
+	}
+	pthread_mutex_unlock(&dep1->list_prot);
+}
+
+int compare_costs(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+/* returns how many sub-tasks partition pnum should be split into (1 = not skewed) */
+int skew_chunks(RDD *rdd, int pnum)
+{
+	RDD *dep = rdd->dependencies[0];
+	if (executor_pool || threads->num_threads < 2 || (rdd->trans != MAP && rdd->trans != FILTER && rdd->trans != JOIN) ||
+		rdd->fn == coalesce_partitions || rdd->fn == repartition_records || rdd->fn == deal_records ||
+		(dep->trans == MAP && dep->fn == identity)) { // record counts of files aren't known up front
+		return 1;
 	}
 
-	rdd->addedtoqueue = calloc(numfiles, sizeof(int));
-	if (rdd->addedtoqueue == NULL) {
-		printf("malloc error\n");
-		exit(1);
+	int n = rdd->partitions->capacity;
+	long *costs = malloc(n * sizeof(long));
+	partition_costs(rdd, costs);
+	long cost = costs[pnum];
+
+	int sampled = 0;
+	for (int i = 0; i < n; i++) {
+		if (costs[i] >= 0) {
+			costs[sampled++] = costs[i];
+		}
 	}
+	if (cost < SKEW_MIN_COST || sampled < 3) {
+		free(costs);
+		return 1;
+	}
+	qsort(costs, sampled, sizeof(long), compare_costs);
+	long median = costs[sampled / 2] > 0 ? costs[sampled / 2] : 1;
+	free(costs);
 
-	for (int i = 0; i < numfiles; i++) {
-		rdd->addedtoqueue[i] = 1; // all partitions are not added to queue
+	if (cost <= SKEW_FACTOR * median) {
+		return 1;
 	}
 
-	rdd->fullymaterialized = 1;
+	pthread_mutex_lock(&dep->list_prot);
+	int records = ((List *)get_nth_element(dep->partitions, pnum))->size;
+	pthread_mutex_unlock(&dep->list_prot);
 
-	return rdd;
+	long chunks = cost / median;
+	if (chunks > threads->num_threads) {
+		chunks = threads->num_threads;
+	}
+	if (chunks > records) {
+		chunks = records;
+	}
+	return chunks;
 }
 
-/* NEW INFO UNLOCKED: each RDD should have a Task PER partition to be added into queue */
-Task *init_task(RDD *rdd, int pnum)
+/* queues the sub-tasks of a skewed partition */
+void submit_split(Job *job, RDD *rdd, int pnum, int chunks)
 {
-	Task *task = malloc(sizeof(Task));
-	task->rdd = rdd;
-	task->pnum = pnum;
-	task->metric = malloc(sizeof(TaskMetric));
-	clock_gettime(CLOCK_MONOTONIC, &task->metric->created);
-	task->metric->rdd = rdd;
-	task->metric->pnum = pnum;
-	task->metric->duration = 0;
-	return task;
+	RDD *dep = rdd->dependencies[0];
+	pthread_mutex_lock(&dep->list_prot);
+	int records = ((List *)get_nth_element(dep->partitions, pnum))->size;
+	pthread_mutex_unlock(&dep->list_prot);
+
+	Split *split = malloc(sizeof(Split));
+	split->chunks = chunks;
+	split->remaining = chunks;
+	split->outputs = calloc(chunks, sizeof(List *));
+	pthread_mutex_init(&split->mutex, NULL);
+
+	for (int c = 0; c < chunks; c++) {
+		Task *task = init_task(rdd, pnum);
+		TaskState *state = (TaskState *)task;
+		state->split = split;
+		state->chunk = c;
+		state->start = (long)records * c / chunks;
+		state->end = c == chunks - 1 ? INT_MAX : (long)records * (c + 1) / chunks;
+		thread_pool_submit(job, task);
+		clock_gettime(CLOCK_MONOTONIC, &task->metric->scheduled);
+	}
 }
 
 /* queues all ready partitions (previous partition(s) have already been materialized AND not partitioner type) */
-void queue_ready_partitions(RDD *rdd)
+void queue_ready_partitions(Job *job, RDD *rdd, int first, int last)
 {
 	if (rdd->fullymaterialized == 1) {
 		return;
 	}
 
-	for (int i = 0; i < rdd->partitions->capacity; i++) {
+	for (int i = first; i < last && i < rdd->partitions->capacity; i++) {
 		pthread_mutex_lock(&rdd->list_prot);
 		if (rdd->ismaterialized[i] || rdd->addedtoqueue[i]) {
 			pthread_mutex_unlock(&rdd->list_prot);
@@ -758,8 +2595,15 @@ void queue_ready_partitions(RDD *rdd)
 			RDD *child = rdd->dependencies[dep];
 
 			if (rdd->trans == MAP || rdd->trans == FILTER) {
-				if (!child->ismaterialized[i]) {
-					dependencies_ready = 0;
+				int first, last;
+				input_range(rdd, dep, i, i + 1, &first, &last);
+				for (int j = first; j < last; j++) {
+					if (!child->ismaterialized[j]) {
+						dependencies_ready = 0;
+						break;
+					}
+				}
+				if (!dependencies_ready) {
 					break;
 				}
 			} else if (rdd->trans == JOIN) { // since JOIN requires both dependencies, the for loop doesn't matter, but the structure is already set so its inefficient ._.
@@ -784,8 +2628,15 @@ void queue_ready_partitions(RDD *rdd)
 		}
 
 		if (dependencies_ready) {
+			int chunks = job->limit ? 1 : skew_chunks(rdd, i); // chunks can't be cancelled on their own
+			if (chunks > 1) {
+				submit_split(job, rdd, i, chunks);
+				rdd->addedtoqueue[i] = 1;
+				continue;
+			}
+
 			Task *task = init_task(rdd, i);
-			thread_pool_submit(task);
+			thread_pool_submit(job, task);
 			if (rdd->trans == PARTITIONBY) {
 				for (int j = 0; j < rdd->partitions->capacity; j++) {
 					rdd->addedtoqueue[j] = 1;
@@ -798,42 +2649,377 @@ void queue_ready_partitions(RDD *rdd)
 	}
 }
 
-/* recursively iterates through given RDD, adding ready partitions into Task queue */
-void iterate_rdd(RDD *rdd)
+/* recursively iterates through given RDD, adding ready partitions in [first, last)
+ * and whatever they depend on into the job's Task queue */
+void iterate_rdd(Job *job, RDD *rdd, int first, int last)
 {
 	if (rdd->fullymaterialized) {
 		return;
 	}
 
 	for (int i = 0; i < rdd->numdependencies; i++) {
-		iterate_rdd(rdd->dependencies[i]);
+		// e.g. PARTITIONBY needs all of its input whatever partitions we want
+		int dfirst, dlast;
+		input_range(rdd, i, first, last, &dfirst, &dlast);
+		iterate_rdd(job, rdd->dependencies[i], dfirst, dlast);
 	}
 
-	queue_ready_partitions(rdd);
+	queue_ready_partitions(job, rdd, first, last);
 
 	if (contains_unmaterialized(rdd->ismaterialized, rdd->partitions->capacity) == 0) {
 		rdd->fullymaterialized = 1;
 	}
 }
 
-void main_thread_fcn(RDD *rdd) // jump
+/* Speculative execution, off unless turned on with MS_SetSpeculation: a task
+ * that has been running SPECULATION_FACTOR times longer than the median runtime
+ * of its RDD's finished tasks gets a copy queued behind it. Whichever copy
+ * finishes first publishes the partition (see publish_partition), so user
+ * functions of speculated tasks may run twice on the same input records, at
+ * the same time. PARTITIONBY tasks, chunks of split partitions and tasks
+ * reading files are never speculated, as they can't run twice safely or
+ * cheaply. */
+#define SPECULATION_FACTOR 4
+#define SPECULATION_MIN_FINISHED 3
+#define SPECULATION_MIN_MICROS 100000
+#define SPECULATION_INTERVAL_MICROS 50000
+
+int speculation = 0;
+
+void MS_SetSpeculation(int enabled)
 {
-    pthread_mutex_lock(&threads->work_queue->mutex);
-    while (rdd->fullymaterialized != 1) {
-        // Submit all ready tasks first
-        iterate_rdd(rdd);
+	__atomic_store_n(&speculation, enabled, __ATOMIC_RELAXED);
+}
 
-        // Wait only if there are active workers or pending tasks
-        if (threads->active_count > 0 || threads->work_queue->head != NULL) {
-            pthread_cond_wait(&threads->main_cond, &threads->work_queue->mutex);
-        }
-    }
-    pthread_mutex_unlock(&threads->work_queue->mutex);
+/* median runtime of the finished tasks of rdd, -1 if there are too few; needs status_mutex */
+long median_duration(RDD *rdd)
+{
+	long *durations = malloc((threads->num_finished + 1) * sizeof(long));
+	int n = 0;
+	for (int i = 0; i < threads->num_finished; i++) {
+		if (threads->finished[i].rdd == rdd && !threads->finished[i].split) {
+			durations[n++] = threads->finished[i].duration;
+		}
+	}
+
+	long median = -1;
+	if (n >= SPECULATION_MIN_FINISHED) {
+		qsort(durations, n, sizeof(long), compare_costs);
+		median = durations[n / 2];
+	}
+	free(durations);
+	return median;
+}
+
+/* called by threads waiting on a job, holding the pool mutex */
+void speculate_stragglers()
+{
+	if (!__atomic_load_n(&speculation, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&threads->status_mutex);
+	for (int i = 0; i < threads->max_threads; i++) { // retiring workers may still be running a task
+		TaskState *state = threads->running[i];
+		if (state == NULL || state->speculated || state->copy || state->split || state->job->done) {
+			continue;
+		}
+		RDD *rdd = state->task.rdd;
+		RDD *dep = rdd->dependencies[0];
+		if (rdd->trans == PARTITIONBY || (dep->trans == MAP && dep->fn == identity)) {
+			continue;
+		}
+
+		long elapsed = TIME_DIFF_MICROS(state->started, now);
+		long median = median_duration(rdd);
+		if (median < 0 || elapsed < SPECULATION_MIN_MICROS || elapsed < SPECULATION_FACTOR * median) {
+			continue;
+		}
+
+		state->speculated = 1;
+		Task *copy = init_task(rdd, state->task.pnum);
+		((TaskState *)copy)->copy = 1;
+		thread_pool_submit(state->job, copy);
+		clock_gettime(CLOCK_MONOTONIC, &copy->metric->scheduled);
+	}
+	pthread_mutex_unlock(&threads->status_mutex);
+}
+
+/* checks whether a job has all it asked for, holding the pool mutex */
+int job_finished(Job *job)
+{
+	RDD *rdd = job->rdd;
+	if (rdd->fullymaterialized) {
+		return 1;
+	}
+
+	int finished = 1;
+	long records = 0;
+	pthread_mutex_lock(&rdd->list_prot);
+	LinkedListNode *current = rdd->partitions->head;
+	for (int i = 0; i < job->want; i++, current = current->next) {
+		if (!rdd->ismaterialized[i]) {
+			finished = 0;
+			break;
+		}
+		records += ((List *)current->ptr)->size;
+	}
+	pthread_mutex_unlock(&rdd->list_prot);
+	return finished || (job->limit > 0 && records >= job->limit);
+}
+
+/* Drops the tasks a finished job still has queued and lets other jobs queue
+ * those partitions again. Returns whether anything was dropped. */
+int cancel_queued(Job *job)
+{
+	int cancelled = 0;
+	while (job->queue.head) {
+		Task *task = pop_queue(&job->queue);
+		RDD *rdd = task->rdd;
+		if (!((TaskState *)task)->copy) { // copies run beside an original that is still queued or running
+			if (rdd->trans == PARTITIONBY) {
+				for (int j = 0; j < rdd->partitions->capacity; j++) {
+					rdd->addedtoqueue[j] = 0;
+				}
+			} else {
+				rdd->addedtoqueue[task->pnum] = 0;
+			}
+			cancelled = 1;
+		}
+		free(task->metric);
+		free(task);
+	}
+	return cancelled;
+}
+
+/* queues whatever became ready in every job and retires the finished ones, holding the pool mutex */
+void reschedule_jobs()
+{
+	int again = 1;
+	while (again) { // cancelled partitions may be needed by jobs visited earlier
+		again = 0;
+		Job **link = &threads->jobs;
+		while (*link) {
+			Job *job = *link;
+			// Submit all ready tasks first
+			if (!job->failed) {
+				iterate_rdd(job, job->rdd, 0, job->want);
+			}
+
+			if (job->failed || job_finished(job)) {
+				job->done = 1;
+				*link = job->next;
+				again |= cancel_queued(job);
+				pthread_cond_broadcast(&job->done_cond);
+			} else {
+				link = &job->next;
+			}
+		}
+	}
+}
+
+/* Executors are forked per job with that job's DAG, so jobs take turns in
+ * executor mode. job_start queues them on the executor pool, and once the job
+ * owning the executors is done and its last task has finished, they are
+ * restarted for the next one. Called from job_start and by workers after each
+ * task, holding the pool mutex. */
+void executors_next()
+{
+	while (1) {
+		Job *owner = executor_pool->owner;
+		if (owner && (!owner->done || owner->running > 0)) {
+			return;
+		}
+		if (owner) {
+			executors_stop();
+			executor_pool->owner = NULL;
+		}
+
+		Job *job = executor_pool->waiting;
+		if (job == NULL) {
+			return;
+		}
+		executor_pool->waiting = job->next;
+		if (executor_pool->waiting == NULL) {
+			executor_pool->waiting_tail = NULL;
+		}
+		executor_pool->owner = job;
+		executors_start(job->rdd);
+		job->next = threads->jobs;
+		threads->jobs = job;
+		reschedule_jobs(); // it may have nothing left to do, then the loop moves on
+	}
+}
+
+Job *job_start(RDD *rdd, int weight, int want, int limit)
+{
+	Job *job = malloc(sizeof(Job));
+	job->rdd = rdd;
+	job->weight = weight > 0 ? weight : 1;
+	job->want = want;
+	job->limit = limit;
+	job->queue.head = job->queue.tail = NULL;
+	job->running = 0;
+	job->done = 0;
+	job->failed = 0;
+	pthread_cond_init(&job->done_cond, NULL);
+
+	pthread_mutex_lock(&threads->mutex);
+	job->id = threads->num_jobs++;
+	if (executor_pool) {
+		job->next = NULL;
+		if (executor_pool->waiting_tail) {
+			executor_pool->waiting_tail->next = job;
+		} else {
+			executor_pool->waiting = job;
+		}
+		executor_pool->waiting_tail = job;
+		executors_next();
+	} else {
+		job->next = threads->jobs;
+		threads->jobs = job;
+		reschedule_jobs();
+	}
+	pthread_mutex_unlock(&threads->mutex);
+	return job;
+}
+
+/* Starts materializing rdd on the shared pool and returns right away. Jobs get
+ * pool time in proportion to their weight (>= 1) while they compete for it.
+ * In executor mode jobs run one at a time, in the order they were submitted
+ * (see executors_next). Every job must be passed to job_wait, which frees it. */
+Job *job_submit(RDD *rdd, int weight)
+{
+	return job_start(rdd, weight, rdd->partitions->capacity, 0);
+}
+
+#ifdef MS_PROFILE
+/* adds rdd and everything it depends on to `stages`, dependencies first */
+void collect_stages(RDD *rdd, List *stages)
+{
+	for (LinkedListNode *current = stages->head; current; current = current->next) {
+		if (current->ptr == rdd) {
+			return;
+		}
+	}
+	for (int i = 0; i < rdd->numdependencies; i++) {
+		collect_stages(rdd->dependencies[i], stages);
+	}
+	list_add_elem(stages, rdd);
+}
+
+/* writes one row per RDD the job computed, summing the profiles of its tasks */
+void profile_report(long job, RDD *root)
+{
+	const char *names[] = { "MAP", "FILTER", "JOIN", "PARTITIONBY" };
+	List *stages = list_init(8);
+	collect_stages(root, stages);
+	Profile *totals = calloc(stages->size, sizeof(Profile));
+
+	pthread_mutex_lock(&threads->status_mutex);
+	for (int i = 0; i < threads->num_finished; i++) {
+		FinishedTask *finished = &threads->finished[i];
+		if (finished->job != job) {
+			continue;
+		}
+		int s = 0;
+		for (LinkedListNode *current = stages->head; s < stages->size; current = current->next, s++) {
+			if (current->ptr == finished->rdd) {
+				Profile *total = &totals[s];
+				total->tasks += finished->profile.tasks;
+				total->records_in += finished->profile.records_in;
+				total->records_out += finished->profile.records_out;
+				total->bytes_in += finished->profile.bytes_in;
+				total->user_nanos += finished->profile.user_nanos;
+				total->lock_nanos += finished->profile.lock_nanos;
+				total->run_nanos += finished->profile.run_nanos;
+				total->queue_nanos += finished->profile.queue_nanos;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&threads->status_mutex);
+
+	pthread_mutex_lock(&metric_queue->mutex);
+	FILE *fp = metric_queue->profile_fp;
+	fprintf(fp, "Job %ld (RDD %p) -- times in usec\n", job, root);
+	fprintf(fp, "%-16s %-11s %6s %10s %10s %7s %12s %10s %10s %10s %10s\n", "RDD", "Trans", "Tasks", "RecordsIn",
+			"RecordsOut", "Select", "BytesIn", "User", "Engine", "Lock", "Queue");
+	int s = 0;
+	for (LinkedListNode *current = stages->head; s < stages->size; current = current->next, s++) {
+		RDD *rdd = current->ptr;
+		Profile *total = &totals[s];
+		if (total->tasks == 0) { // file inputs, or materialized by an earlier job
+			continue;
+		}
+		fprintf(fp, "%-16p %-11s %6ld %10ld %10ld %7.3f %12ld %10ld %10ld %10ld %10ld\n",
+				rdd, rdd->trans <= PARTITIONBY ? names[rdd->trans] : "?", total->tasks,
+				total->records_in, total->records_out,
+				total->records_in ? (double)total->records_out / total->records_in : 0.0,
+				total->bytes_in, total->user_nanos / 1000,
+				(total->run_nanos - total->user_nanos - total->lock_nanos) / 1000,
+				total->lock_nanos / 1000, total->queue_nanos / 1000);
+		if (rdd->fn == semi_join_records && ((BloomSpec *)rdd->ctx)->build->run_nanos > 0) {
+			Profile *build = ((BloomSpec *)rdd->ctx)->build;
+			fprintf(fp, "%-16s %-11s %6s %10ld %10s %7s %12s %10ld %10ld %10ld %10s\n",
+					"", "bloom build", "", build->records_in, "", "", "", build->user_nanos / 1000,
+					(build->run_nanos - build->user_nanos - build->lock_nanos) / 1000,
+					build->lock_nanos / 1000, "");
+			memset(build, 0, sizeof(Profile)); // built once, so only report it once
+		}
+	}
+	fflush(fp);
+	pthread_mutex_unlock(&metric_queue->mutex);
+
+	free(totals);
+	list_free(stages);
+}
+#else
+#define profile_report(job, root) ((void)(job), (void)(root))
+#endif
+
+/* Returns once the job's rdd is materialized; the job must not be used afterwards. */
+int job_wait(Job *job) // jump
+{
+	pthread_mutex_lock(&threads->mutex);
+	// Losing speculative copies may still be running user code on the job's
+	// RDDs and their ctx once it is done, so wait for them too.
+	while (!job->done || job->running > 0) {
+		// wake up now and then to look for stragglers
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += SPECULATION_INTERVAL_MICROS * 1000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&job->done_cond, &threads->mutex, &deadline);
+		speculate_stragglers();
+		adapt_pool();
+	}
+	long id = job->id;
+	RDD *rdd = job->rdd;
+	int failed = job->failed;
+	pthread_mutex_unlock(&threads->mutex);
+
+	profile_report(id, rdd);
+	forget_finished(id);
+	job_free(job);
+	return failed ? -1 : 0;
+}
+
+/* materializes (at least) what job_start was asked for and waits for it */
+int run_job(RDD *rdd, int want, int limit)
+{
+	return job_wait(job_start(rdd, 1, want, limit));
 }
 
-void execute(RDD *rdd)
+int execute(RDD *rdd)
 {
-	main_thread_fcn(rdd);
+	return run_job(rdd, rdd->partitions->capacity, 0);
 	/*
 	 how will the locking go ?
 	 once we call threads on all the leaf nodes (reading from files), and threads with dependencies show up, then we can start placing them in condition variables (if we go from order we add them,
@@ -849,43 +3035,87 @@ void execute(RDD *rdd)
 	when it's empty, we can restart the loop (maybe make this an infinite loop?) which allows us to call iterate_rdd again
 	we will also change iterate_rdd to now just add all RDDs that have their dependencies filled to the Task queue
 	*/
-
-	return;
 }
 
-void MS_Run()
+int cores_available()
 {
-	// Create a thread pool, work queue, and worker threads
-	
 	cpu_set_t set;
 	CPU_ZERO(&set);
 	if (sched_getaffinity(0, sizeof(set), &set) == -1) {
 		perror("sched_getaffinity");
 		exit(1);
 	}
+	return CPU_COUNT(&set);
+}
+
+/* Like MS_Run, but the pool is kept between min_threads and max_threads
+ * workers (see adapt_pool). Equal bounds give a fixed-size pool. */
+void MS_RunBounded(int min_threads, int max_threads)
+{
+	if (min_threads < 1 || max_threads < min_threads) {
+		printf("Invalid thread pool bounds %d to %d\n", min_threads, max_threads);
+		exit(1);
+	}
 
-	int cores_available = CPU_COUNT(&set);
-	thread_pool_init(cores_available - 1); // 1 for the metric thread
+	// Create a thread pool, work queue, and worker threads
+	thread_pool_init(min_threads, max_threads, cores_available());
 
 	// Create the task metric queue and start the metrics monitor thread
 	metric_queue_init();
 	return;
 }
 
+void MS_Run()
+{
+	int cores = cores_available();
+	MS_RunBounded(max(cores - 1, 1), POOL_THREADS_PER_CORE * cores); // 1 for the metric thread
+}
+
+/* Like MS_Run, but tasks are executed by `num_executors` separate processes on
+ * this machine, talking to this one over Unix sockets. */
+void MS_RunExecutors(int num_executors, Serializer ser, Deserializer des)
+{
+	if (num_executors < 1) {
+		printf("Invalid number of executors %d\n", num_executors);
+		exit(1);
+	}
+
+	executor_pool = malloc(sizeof(ExecutorPool));
+	executor_pool->executors = calloc(num_executors, sizeof(Executor));
+	executor_pool->num_executors = num_executors;
+	executor_pool->ser = ser;
+	executor_pool->des = des;
+	executor_pool->root = NULL;
+	executor_pool->owner = NULL;
+	executor_pool->waiting = executor_pool->waiting_tail = NULL;
+
+	signal(SIGPIPE, SIG_IGN); // a dead executor must show up as a write error, not kill the driver
+
+	thread_pool_init(num_executors, num_executors, cores_available()); // one proxy thread per executor
+	metric_queue_init();
+}
+
 void MS_TearDown()
 {
 	// Destroy the thread pool.
 	// Wait for the metrics thread to finish and join it.
 	// Free any allocations (thread pools, queues, RDDs).
-	metric_queue_clean();
 	thread_pool_wait();
 	thread_pool_destroy();
 	// handle freeing allocatings in thread_pool_destroy
+	metric_queue_clean(); // after the workers are gone, as they still report metrics
+	if (executor_pool) {
+		free(executor_pool->executors);
+		free(executor_pool);
+		executor_pool = NULL;
+	}
 }
 
 int count(RDD *rdd)
 {
-	execute(rdd);
+	if (execute(rdd) != 0) {
+		return -1;
+	}
 
 	int count = 0;
 	// count all the items in rdd
@@ -904,7 +3134,9 @@ int count(RDD *rdd)
 
 void print(RDD *rdd, Printer p)
 {
-	execute(rdd);
+	if (execute(rdd) != 0) {
+		return;
+	}
 	// print all the items in rdd
 	// aka... `p(item)` for all items in rdd
 	for (int i = 0; i < rdd->partitions->capacity; i++) {
@@ -919,3 +3151,216 @@ void print(RDD *rdd, Printer p)
 	}
 }
 
+/* flushes fp all the way to disk and closes it */
+int close_durably(FILE *fp)
+{
+	int ret = fflush(fp) == 0 && fsync(fileno(fp)) == 0 ? 0 : -1;
+	if (fclose(fp) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+/* makes the creations, renames and unlinks done in dir so far durable */
+int sync_dir(char *dir)
+{
+	int dirfd = open(dir, O_RDONLY);
+	if (dirfd < 0 || fsync(dirfd) != 0) {
+		perror("fsync");
+		if (dirfd >= 0) {
+			close(dirfd);
+		}
+		return -1;
+	}
+	close(dirfd);
+	return 0;
+}
+
+/* Materializes `rdd` and writes its partitions to `dir` (created if needed),
+ * one file per partition plus a manifest. The parts are synced to disk before
+ * the manifest is renamed into place, so an interrupted checkpoint, even by a
+ * machine crash, is never picked up by RDDFromCheckpoint. */
+int checkpoint(RDD *rdd, char *dir, Serializer fn)
+{
+	if (rdd->numdependencies == 0 && rdd->fn == identity) {
+		printf("Cannot checkpoint an RDD read directly from files\n");
+		return -1;
+	}
+
+	if (execute(rdd) != 0) {
+		return -1;
+	}
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		perror("mkdir");
+		return -1;
+	}
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/manifest", dir);
+	if (unlink(path) != 0 && errno != ENOENT) { // invalidate any older checkpoint first
+		perror("unlink");
+		return -1;
+	}
+	if (sync_dir(dir) != 0) { // before its parts are overwritten
+		return -1;
+	}
+
+	uint32_t numpartitions = rdd->partitions->capacity;
+	for (uint32_t i = 0; i < numpartitions; i++) {
+		snprintf(path, sizeof(path), "%s/part-%05u", dir, i);
+		FILE *fp = fopen(path, "w");
+		if (fp == NULL) {
+			perror("fopen");
+			return -1;
+		}
+		int ret = write_partition(fp, get_nth_element(rdd->partitions, i), fn);
+		if (close_durably(fp) != 0 || ret != 0) {
+			printf("Error writing checkpoint partition %s\n", path);
+			return -1;
+		}
+	}
+
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s/manifest.tmp", dir);
+	FILE *fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	int ret = 0;
+	if (fwrite(CHECKPOINT_MAGIC, 1, 4, fp) != 4 || fwrite(&numpartitions, sizeof(numpartitions), 1, fp) != 1) {
+		ret = -1;
+	}
+	if (close_durably(fp) != 0 || ret != 0) {
+		printf("Error writing checkpoint manifest %s\n", tmp);
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/manifest", dir);
+	if (rename(tmp, path) != 0) {
+		perror("rename");
+		return -1;
+	}
+	return sync_dir(dir);
+}
+
+/* Copies the first n elements of rdd (in partition order) into out and returns
+ * how many there were. Partitions are materialized a few at a time, starting
+ * with the first one, and the job stops as soon as the leading partitions hold
+ * n elements; tasks still queued at that point are dropped. */
+int take(RDD *rdd, int n, void **out)
+{
+	int numpartitions = rdd->partitions->capacity;
+	int taken = 0;
+	int scanned = 0; // partitions already copied from
+	int want = 1;
+
+	while (taken < n && scanned < numpartitions) {
+		if (run_job(rdd, want, n) != 0) { // partitions before `scanned` hold exactly `taken` elements
+			return -1;
+		}
+
+		for (; scanned < want && taken < n; scanned++) {
+			pthread_mutex_lock(&rdd->list_prot);
+			int ready = rdd->ismaterialized[scanned];
+			List *part = get_nth_element(rdd->partitions, scanned);
+			pthread_mutex_unlock(&rdd->list_prot);
+			if (!ready) { // stopped early, the leading partitions were enough
+				break;
+			}
+			for (LinkedListNode *current = part->head; current && taken < n; current = current->next) {
+				if (current->ptr != NULL) {
+					out[taken++] = current->ptr;
+				}
+			}
+		}
+
+		// like Spark, scan more partitions each round when the first ones came up short
+		want = want * 4 < numpartitions ? want * 4 : numpartitions;
+	}
+	return taken;
+}
+
+/* The first element of rdd, or NULL if it is empty. */
+void *first(RDD *rdd)
+{
+	void *elem;
+	return take(rdd, 1, &elem) == 1 ? elem : NULL;
+}
+
+/* Estimates the number of distinct elements of rdd, as told apart by fn,
+ * with a HyperLogLog sketch of 2^precision registers (relative error about
+ * 1.04 / sqrt(2^precision)). Every partition is sketched by a pool task and
+ * only the sketches are merged here, so no shuffle is needed. */
+long countApproxDistinct(RDD *rdd, Hasher fn, int precision)
+{
+	if (precision < 4 || precision > 16) {
+		printf("HyperLogLog precision must be between 4 and 16\n");
+		return -1;
+	}
+	if (rdd->numdependencies == 0 && rdd->fn == identity) {
+		printf("Cannot sketch an RDD read directly from files, map it first\n");
+		return -1;
+	}
+
+	// on the heap like every other ctx, and freed only after execute(), which
+	// returns once every task of the job (speculative copies included) is done
+	SketchSpec *spec = malloc(sizeof(SketchSpec));
+	spec->fn = fn;
+	spec->precision = precision;
+	RDD *sketches = create_rdd(1, MAP, build_sketch, rdd);
+	sketches->partitions = list_init(rdd->partitions->capacity);
+	sketches->ctx = spec;
+	int failed = execute(sketches);
+
+	Sketch *merged = sketch_init(precision);
+	int m = 1 << precision;
+	for (int i = 0; i < sketches->partitions->capacity; i++) {
+		List *part = get_nth_element(sketches->partitions, i);
+		if (part == NULL) { // the job failed
+			continue;
+		}
+		for (LinkedListNode *current = part->head; current; current = current->next) {
+			Sketch *sketch = current->ptr;
+			if (sketch == NULL) {
+				continue;
+			}
+			for (int j = 0; j < m; j++) {
+				if (sketch->registers[j] > merged->registers[j]) {
+					merged->registers[j] = sketch->registers[j];
+				}
+			}
+			free(sketch);
+			current->ptr = NULL;
+		}
+		list_free(part);
+	}
+
+	// the sketches RDD is internal, nothing else can reach it
+	metric_queue_flush();
+	list_free(sketches->partitions);
+	free(sketches->ismaterialized);
+	free(sketches->addedtoqueue);
+	free(spec);
+	free(sketches);
+	if (failed) {
+		free(merged);
+		return -1;
+	}
+
+	double sum = 0;
+	int zeros = 0;
+	for (int j = 0; j < m; j++) {
+		sum += 1.0 / (1ULL << merged->registers[j]);
+		zeros += merged->registers[j] == 0;
+	}
+	free(merged);
+
+	double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m);
+	double estimate = alpha * m * m / sum;
+	if (estimate <= 2.5 * m && zeros > 0) { // small cardinalities: linear counting is more accurate
+		estimate = m * natural_log((double)m / zeros);
+	}
+	return (long)(estimate + 0.5);
+}
@@ -0,0 +1,63 @@
+#ifndef __minispark_ext_h__
+#define __minispark_ext_h__
+
+/* Public API added on top of minispark.h: checkpoints, executors, jobs and
+ * the extra transforms and actions implemented in minispark.c. */
+
+#include "minispark.h"
+
+/* Checkpoint (de)serializers. A Serializer encodes one element into a malloc'd
+ * buffer and stores its length in `len`; a Deserializer rebuilds an element
+ * from such a buffer (the buffer is freed by minispark afterwards). Elements
+ * returned by a Deserializer must be malloc'd, so minispark can free them if
+ * a partition turns out to be corrupt. */
+typedef void *(*Serializer)(void *elem, size_t *len);
+typedef void *(*Deserializer)(void *buf, size_t len);
+
+RDD *RDDFromCheckpoint(char *dir, Deserializer fn);
+int checkpoint(RDD *rdd, char *dir, Serializer fn);
+
+/* Like MS_Run, but tasks run in num_executors (>= 1) forked processes on this
+ * machine, reached over Unix sockets. A task whose executor keeps crashing
+ * fails its job: count() and take() then return -1 and print() prints
+ * nothing. */
+void MS_RunExecutors(int num_executors, Serializer ser, Deserializer des);
+
+/* Like MS_Run, but the pool grows and shrinks between min_threads and
+ * max_threads workers as the load changes. */
+void MS_RunBounded(int min_threads, int max_threads);
+
+/* Turns speculative execution on (1) or off (0, the default). When on, a task
+ * running much longer than the other tasks of its RDD gets a copy started on
+ * another worker, and the first to finish wins. The copy runs the same user
+ * functions on the same input records while the original may still be running
+ * them, so with speculation on, functions must not free, modify or otherwise
+ * consume their input. */
+void MS_SetSpeculation(int enabled);
+
+/* Concurrent jobs on the shared pool. job_submit starts materializing rdd and
+ * returns right away; jobs get pool time in proportion to their weight (>= 1).
+ * job_wait blocks until the job is done and frees it, so every submitted job
+ * must be waited on. In executor mode jobs run one at a time, in submission
+ * order, but job_submit still returns right away. */
+typedef struct Job Job;
+Job *job_submit(RDD *rdd, int weight);
+int job_wait(Job *job); // 0, or -1 if the job failed
+
+/* Maps an element to a 64-bit hash of the value it is counted or joined by. */
+typedef unsigned long (*Hasher)(void *arg);
+
+/* take copies up to n elements of rdd, in partition order, into out and
+ * returns how many it copied; only as many partitions as needed are built. */
+int take(RDD *rdd, int n, void **out);
+void *first(RDD *rdd);
+
+long countApproxDistinct(RDD *rdd, Hasher fn, int precision);
+RDD *sample(RDD *dep, double fraction, unsigned long seed);
+
+RDD *coalesce(RDD *dep, int numpartitions);
+RDD *repartition(RDD *dep, int numpartitions);
+
+RDD *semiJoinFilter(RDD *large, RDD *small, Hasher largekey, Hasher smallkey, double fpp);
+
+#endif
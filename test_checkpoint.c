@@ -0,0 +1,181 @@
+/* Checks that an RDD written by checkpoint() loads back unchanged with
+ * RDDFromCheckpoint, that checkpointing over an older checkpoint replaces it,
+ * and that a missing or corrupt part or manifest makes RDDFromCheckpoint
+ * return NULL rather than exit.
+ *
+ *   gcc -o test_checkpoint test_checkpoint.c minispark.c -pthread && ./test_checkpoint
+ *
+ * Exits with status 0 if every check passes. */
+#include "minispark_ext.h"
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#define NUMFILES 3
+#define LINES 4000
+#define KEYS 100
+
+typedef struct {
+	int key;
+	char tag;
+} Record;
+
+char dir[] = "/tmp/minispark-test-XXXXXX";
+char ckpt[96];
+
+void *parse(void *arg)
+{
+	FILE *fp = arg;
+	int key;
+	char tag;
+	if (fscanf(fp, "%d %c", &key, &tag) != 2) {
+		return NULL;
+	}
+	Record *r = malloc(sizeof(Record));
+	r->key = key;
+	r->tag = tag;
+	return r;
+}
+
+int has_tag(void *arg, void *ctx)
+{
+	return ((Record *)arg)->tag == *(char *)ctx;
+}
+
+unsigned long by_key(void *arg, int numpartitions, void *ctx)
+{
+	(void)ctx;
+	return ((Record *)arg)->key % numpartitions;
+}
+
+void *serialize(void *elem, size_t *len)
+{
+	*len = sizeof(Record);
+	void *buf = malloc(sizeof(Record));
+	memcpy(buf, elem, sizeof(Record));
+	return buf;
+}
+
+void *deserialize(void *buf, size_t len)
+{
+	if (len != sizeof(Record)) {
+		return NULL;
+	}
+	Record *r = malloc(sizeof(Record));
+	memcpy(r, buf, sizeof(Record));
+	return r;
+}
+
+long keysum;
+
+void sum_keys(void *arg)
+{
+	keysum += ((Record *)arg)->key;
+}
+
+int failures = 0;
+
+void check(const char *what, long got, long want)
+{
+	printf("%-40s %8ld %s\n", what, got, got == want ? "ok" : "FAILED");
+	if (got != want) {
+		printf("    expected %ld\n", want);
+		failures++;
+	}
+}
+
+/* path of file `name` inside the checkpoint */
+char *ckpt_file(const char *name)
+{
+	static char path[160];
+	snprintf(path, sizeof(path), "%s/%s", ckpt, name);
+	return path;
+}
+
+void truncate_to(const char *path, long size)
+{
+	if (truncate(path, size) != 0) {
+		perror("truncate");
+		exit(1);
+	}
+}
+
+int main()
+{
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(ckpt, sizeof(ckpt), "%s/ckpt", dir);
+
+	// line i of file f has key (i * 7 + f) % KEYS and tag a, b or c
+	char *files[NUMFILES];
+	long tagged_a = 0, sum_a = 0;
+	for (int f = 0; f < NUMFILES; f++) {
+		files[f] = malloc(96);
+		snprintf(files[f], 96, "%s/in%d.txt", dir, f);
+		FILE *fp = fopen(files[f], "w");
+		for (int i = 0; i < LINES; i++) {
+			int key = (i * 7 + f) % KEYS;
+			char tag = "abc"[(i / 3 + f) % 3];
+			fprintf(fp, "%d %c\n", key, tag);
+			if (tag == 'a') {
+				tagged_a++;
+				sum_a += key;
+			}
+		}
+		fclose(fp);
+	}
+
+	MS_Run();
+	char a = 'a';
+	check("no checkpoint yet", RDDFromCheckpoint(ckpt, deserialize) == NULL, 1);
+
+	RDD *records = map(RDDFromFiles(files, NUMFILES), parse);
+	check("checkpoint all records", checkpoint(records, ckpt, serialize), 0);
+	RDD *as = partitionBy(filter(records, has_tag, &a), by_key, 8, NULL);
+	check("checkpoint over an older one", checkpoint(as, ckpt, serialize), 0);
+
+	RDD *loaded = RDDFromCheckpoint(ckpt, deserialize);
+	check("loaded", loaded != NULL, 1);
+	if (loaded != NULL) {
+		check("  partitions", loaded->numpartitions, 8);
+		check("  records", count(loaded), tagged_a);
+		print(loaded, sum_keys);
+		check("  sum of keys", keysum, sum_a);
+		check("  filter on top", count(filter(loaded, has_tag, &a)), tagged_a);
+	}
+
+	// the checks below corrupt the checkpoint one way at a time
+	truncate_to(ckpt_file("part-00001"), 20);
+	check("truncated part", RDDFromCheckpoint(ckpt, deserialize) == NULL, 1);
+
+	check("checkpoint again", checkpoint(as, ckpt, serialize), 0);
+	unlink(ckpt_file("part-00007"));
+	check("missing part", RDDFromCheckpoint(ckpt, deserialize) == NULL, 1);
+
+	check("checkpoint again", checkpoint(as, ckpt, serialize), 0);
+	FILE *fp = fopen(ckpt_file("manifest"), "r+");
+	uint32_t huge = 0x80000000u;
+	fseek(fp, 4, SEEK_SET);
+	fwrite(&huge, sizeof(huge), 1, fp);
+	fclose(fp);
+	check("partition count >= 2^31", RDDFromCheckpoint(ckpt, deserialize) == NULL, 1);
+
+	truncate_to(ckpt_file("manifest"), 6);
+	check("truncated manifest", RDDFromCheckpoint(ckpt, deserialize) == NULL, 1);
+
+	MS_TearDown();
+
+	char cmd[160];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if (system(cmd) != 0) {
+		printf("could not remove %s\n", dir);
+	}
+	for (int f = 0; f < NUMFILES; f++) {
+		free(files[f]);
+	}
+
+	printf("%s\n", failures ? "FAILED" : "all checkpoint checks passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,193 @@
+/* Exercises executor mode with several executors and checks the results
+ * against values computed directly from the generated input. One executor is
+ * killed mid-task to check that its task is retried on a fresh one, and a
+ * mapper that always crashes has to fail its job without taking the driver
+ * down.
+ *
+ *   gcc -o test_executors test_executors.c minispark.c -pthread && ./test_executors
+ *
+ * Exits with status 0 if every check passes. */
+#include "minispark_ext.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define NUMFILES 3
+#define LINES 5000
+#define KEYS 100
+#define EXECUTORS 3
+
+typedef struct {
+	int key;
+	char tag;
+} Record;
+
+char dir[] = "/tmp/minispark-test-XXXXXX";
+char crash_marker[64];
+
+void *parse(void *arg)
+{
+	FILE *fp = arg;
+	int key;
+	char tag;
+	if (fscanf(fp, "%d %c", &key, &tag) != 2) {
+		return NULL;
+	}
+	Record *r = malloc(sizeof(Record));
+	r->key = key;
+	r->tag = tag;
+	return r;
+}
+
+/* kills the executor running it the first time it sees key 42 */
+void *crash_once(void *arg)
+{
+	Record *r = arg;
+	if (r->key == 42) {
+		int fd = open(crash_marker, O_CREAT | O_EXCL | O_WRONLY, 0600);
+		if (fd >= 0) {
+			close(fd);
+			abort();
+		}
+	}
+	return r;
+}
+
+/* kills every executor running it */
+void *crash_always(void *arg)
+{
+	if (((Record *)arg)->key == 13) {
+		abort();
+	}
+	return arg;
+}
+
+int has_tag(void *arg, void *ctx)
+{
+	return ((Record *)arg)->tag == *(char *)ctx;
+}
+
+unsigned long by_key(void *arg, int numpartitions, void *ctx)
+{
+	(void)ctx;
+	return ((Record *)arg)->key % numpartitions;
+}
+
+void *match(void *arg1, void *arg2, void *ctx)
+{
+	(void)ctx;
+	Record *a = arg1, *b = arg2;
+	if (a->key != b->key) {
+		return NULL;
+	}
+	Record *r = malloc(sizeof(Record));
+	r->key = a->key;
+	r->tag = 'j';
+	return r;
+}
+
+void *serialize(void *elem, size_t *len)
+{
+	*len = sizeof(Record);
+	void *buf = malloc(sizeof(Record));
+	memcpy(buf, elem, sizeof(Record));
+	return buf;
+}
+
+void *deserialize(void *buf, size_t len)
+{
+	if (len != sizeof(Record)) {
+		return NULL;
+	}
+	Record *r = malloc(sizeof(Record));
+	memcpy(r, buf, sizeof(Record));
+	return r;
+}
+
+int failures = 0;
+
+void check(const char *what, long got, long want)
+{
+	printf("%-40s %8ld %s\n", what, got, got == want ? "ok" : "FAILED");
+	if (got != want) {
+		printf("    expected %ld\n", want);
+		failures++;
+	}
+}
+
+int main()
+{
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(crash_marker, sizeof(crash_marker), "%s/crashed", dir);
+
+	// line i of file f has key (i * 7 + f) % KEYS and tag a, b or c
+	char *files[NUMFILES];
+	long tagged_a = 0;
+	long a_per_key[KEYS] = { 0 }, b_in_first[KEYS] = { 0 }, b_total = 0;
+	for (int f = 0; f < NUMFILES; f++) {
+		files[f] = malloc(96);
+		snprintf(files[f], 96, "%s/in%d.txt", dir, f);
+		FILE *fp = fopen(files[f], "w");
+		for (int i = 0; i < LINES; i++) {
+			int key = (i * 7 + f) % KEYS;
+			char tag = "abc"[(i / 3 + f) % 3];
+			fprintf(fp, "%d %c\n", key, tag);
+			if (tag == 'a') {
+				tagged_a++;
+				a_per_key[key]++;
+			}
+			if (tag == 'b' && f == 0) {
+				b_in_first[key]++;
+				b_total++;
+			}
+		}
+		fclose(fp);
+	}
+	long joined = 0;
+	for (int k = 0; k < KEYS; k++) {
+		joined += a_per_key[k] * b_in_first[k];
+	}
+
+	char a = 'a', b = 'b';
+	MS_RunExecutors(EXECUTORS, serialize, deserialize);
+
+	RDD *records = map(map(RDDFromFiles(files, NUMFILES), parse), crash_once);
+	check("records", count(records), NUMFILES * LINES);
+	check("executor crashed once", access(crash_marker, F_OK) == 0, 1);
+
+	RDD *as = filter(map(RDDFromFiles(files, NUMFILES), parse), has_tag, &a);
+	check("job_submit + job_wait", job_wait(job_submit(as, 1)), 0);
+	check("then filter", count(as), tagged_a);
+
+	// submitting a second job while the first one runs must not block
+	RDD *bs = filter(map(RDDFromFiles(files, 1), parse), has_tag, &b);
+	RDD *as2 = filter(map(RDDFromFiles(files, NUMFILES), parse), has_tag, &a);
+	Job *jb = job_submit(bs, 1);
+	Job *ja = job_submit(as2, 1);
+	check("two jobs submitted, waited out of order", job_wait(ja) == 0 && job_wait(jb) == 0, 1);
+	check("  first", count(bs), b_total);
+	check("  second", count(as2), tagged_a);
+
+	RDD *joins = join(partitionBy(as, by_key, 8, NULL), partitionBy(bs, by_key, 8, NULL), match, NULL);
+	check("partitionBy + join", count(joins), joined);
+
+	RDD *crashing = map(as, crash_always);
+	check("always crashing mapper fails count", count(crashing), -1);
+	check("and job_wait", job_wait(job_submit(crashing, 1)), -1);
+	check("later jobs still run", count(filter(as, has_tag, &a)), tagged_a);
+
+	MS_TearDown();
+
+	for (int f = 0; f < NUMFILES; f++) {
+		unlink(files[f]);
+		free(files[f]);
+	}
+	unlink(crash_marker);
+	rmdir(dir);
+
+	printf("%s\n", failures ? "FAILED" : "all executor checks passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,91 @@
+/* Checks that the adaptive pool grows while its workers are stuck in long
+ * blocking tasks. Each of 4 partitions holds one record whose mapper sleeps
+ * for a second, far longer than a sizing interval, and the pool starts with a
+ * single worker. If the pool only grew once a task ended, the job would take
+ * at least two sleeps.
+ *
+ *   gcc -o test_pool test_pool.c minispark.c -pthread && ./test_pool
+ *
+ * Exits with status 0 if every check passes. */
+#include "minispark_ext.h"
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define PARTITIONS 4
+#define SLEEP_MICROS 1000000
+#define MAX_THREADS 4
+
+char dir[] = "/tmp/minispark-test-XXXXXX";
+
+void *parse(void *arg)
+{
+	FILE *fp = arg;
+	int key;
+	if (fscanf(fp, "%d", &key) != 1) {
+		return NULL;
+	}
+	int *k = malloc(sizeof(int));
+	*k = key;
+	return k;
+}
+
+unsigned long by_key(void *arg, int numpartitions, void *ctx)
+{
+	(void)ctx;
+	return *(int *)arg % numpartitions;
+}
+
+void *sleepy(void *arg)
+{
+	usleep(SLEEP_MICROS);
+	int *k = malloc(sizeof(int));
+	*k = *(int *)arg;
+	return k;
+}
+
+int failures = 0;
+
+void check(const char *what, long got, long want)
+{
+	printf("%-40s %8ld %s\n", what, got, got == want ? "ok" : "FAILED");
+	if (got != want) {
+		printf("    expected %ld\n", want);
+		failures++;
+	}
+}
+
+int main()
+{
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char file[96];
+	snprintf(file, sizeof(file), "%s/in.txt", dir);
+	FILE *fp = fopen(file, "w");
+	for (int i = 0; i < PARTITIONS; i++) {
+		fprintf(fp, "%d\n", i);
+	}
+	fclose(fp);
+	char *files[] = {file};
+
+	MS_RunBounded(1, MAX_THREADS);
+	RDD *part = partitionBy(map(RDDFromFiles(files, 1), parse), by_key, PARTITIONS, NULL);
+	check("partitioned records", count(part), PARTITIONS);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	check("mapped records", count(map(part, sleepy)), PARTITIONS);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long millis = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	printf("    took %ld ms\n", millis);
+	check("pool grew behind blocking tasks", millis < SLEEP_MICROS / 1000 * 3 / 2, 1);
+	MS_TearDown();
+
+	unlink(file);
+	rmdir(dir);
+
+	printf("%s\n", failures ? "FAILED" : "all pool checks passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,164 @@
+/* Checks that repartition() deals records out evenly. Records are numbered by
+ * their position in the (filtered, so unevenly partitioned) input, and print()
+ * visits the output partitions in order, so partition j shows up as the run of
+ * records whose position is j modulo the partition count. The runs must come
+ * in order, hold their records in input order, and differ in size by at most
+ * one. Runs once on the thread pool and once on executors.
+ *
+ *   gcc -o test_repartition test_repartition.c minispark.c -pthread && ./test_repartition
+ *
+ * Exits with status 0 if every check passes. */
+#include "minispark_ext.h"
+#include <string.h>
+#include <unistd.h>
+
+#define NUMFILES 3
+#define LINES 5000
+#define PARTITIONS 7
+
+typedef struct {
+	int id; // line number across all input files
+	char tag;
+} Record;
+
+char dir[] = "/tmp/minispark-test-XXXXXX";
+
+void *parse(void *arg)
+{
+	FILE *fp = arg;
+	int id;
+	char tag;
+	if (fscanf(fp, "%d %c", &id, &tag) != 2) {
+		return NULL;
+	}
+	Record *r = malloc(sizeof(Record));
+	r->id = id;
+	r->tag = tag;
+	return r;
+}
+
+int not_tag(void *arg, void *ctx)
+{
+	return ((Record *)arg)->tag != *(char *)ctx;
+}
+
+void *serialize(void *elem, size_t *len)
+{
+	*len = sizeof(Record);
+	void *buf = malloc(sizeof(Record));
+	memcpy(buf, elem, sizeof(Record));
+	return buf;
+}
+
+void *deserialize(void *buf, size_t len)
+{
+	if (len != sizeof(Record)) {
+		return NULL;
+	}
+	Record *r = malloc(sizeof(Record));
+	memcpy(r, buf, sizeof(Record));
+	return r;
+}
+
+int *position; // of each kept line id in the filtered input, -1 if filtered out
+long kept;
+
+// runs of consecutive printed records that belong to the same output partition
+int runs, run_sizes[PARTITIONS + 1], run_slot, last_position, out_of_order;
+
+void visit(void *arg)
+{
+	int p = position[((Record *)arg)->id];
+	if (runs == 0 || p % PARTITIONS != run_slot) {
+		if (runs <= PARTITIONS) {
+			run_sizes[runs] = 0;
+		}
+		runs++;
+		run_slot = p % PARTITIONS;
+		if (run_slot != runs - 1) {
+			out_of_order++;
+		}
+	} else if (p < last_position) {
+		out_of_order++;
+	}
+	if (runs <= PARTITIONS) {
+		run_sizes[runs - 1]++;
+	}
+	last_position = p;
+}
+
+int failures = 0;
+
+void check(const char *what, long got, long want)
+{
+	printf("%-40s %8ld %s\n", what, got, got == want ? "ok" : "FAILED");
+	if (got != want) {
+		printf("    expected %ld\n", want);
+		failures++;
+	}
+}
+
+void run(char **files)
+{
+	char c = 'c';
+	RDD *records = filter(map(RDDFromFiles(files, NUMFILES), parse), not_tag, &c);
+	RDD *rp = repartition(records, PARTITIONS);
+	check("  records", count(rp), kept);
+
+	runs = 0;
+	out_of_order = 0;
+	print(rp, visit);
+	check("  partitions", runs, PARTITIONS);
+	check("  records dealt in order", out_of_order, 0);
+	int min = run_sizes[0], max = run_sizes[0];
+	for (int j = 1; j < PARTITIONS && j < runs; j++) {
+		min = run_sizes[j] < min ? run_sizes[j] : min;
+		max = run_sizes[j] > max ? run_sizes[j] : max;
+	}
+	check("  sizes differ by at most one", max - min <= 1, 1);
+}
+
+int main()
+{
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	// file f keeps a different share of its lines, so the inputs are uneven
+	char *files[NUMFILES];
+	position = malloc(NUMFILES * LINES * sizeof(int));
+	kept = 0;
+	for (int f = 0; f < NUMFILES; f++) {
+		files[f] = malloc(96);
+		snprintf(files[f], 96, "%s/in%d.txt", dir, f);
+		FILE *fp = fopen(files[f], "w");
+		for (int i = 0; i < LINES; i++) {
+			int id = f * LINES + i;
+			char tag = i % (f + 2) == 0 ? 'c' : 'a';
+			fprintf(fp, "%d %c\n", id, tag);
+			position[id] = tag == 'c' ? -1 : kept++;
+		}
+		fclose(fp);
+	}
+
+	printf("thread pool:\n");
+	MS_Run();
+	run(files);
+	MS_TearDown();
+
+	printf("executors:\n");
+	MS_RunExecutors(3, serialize, deserialize);
+	run(files);
+	MS_TearDown();
+
+	for (int f = 0; f < NUMFILES; f++) {
+		unlink(files[f]);
+		free(files[f]);
+	}
+	rmdir(dir);
+	free(position);
+
+	printf("%s\n", failures ? "FAILED" : "all repartition checks passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+/* Forces a straggler and checks that speculative execution leaves the result
+ * unchanged. One worker becomes slow on every record of partition 0 it maps,
+ * so the task holding that partition falls far behind the others and gets a
+ * speculative copy when speculation is on. Without MS_SetSpeculation the
+ * mapper must run exactly once per record.
+ *
+ *   gcc -o test_speculation test_speculation.c minispark.c -pthread && ./test_speculation
+ *
+ * Exits with status 0 if every check passes. */
+#include "minispark_ext.h"
+#include <string.h>
+#include <unistd.h>
+
+#define NUMFILES 2
+#define LINES 3000
+#define KEYS 400
+#define PARTITIONS 8
+#define SLOW_MICROS 2000
+
+typedef struct {
+	int key;
+	char tag;
+} Record;
+
+char dir[] = "/tmp/minispark-test-XXXXXX";
+
+void *parse(void *arg)
+{
+	FILE *fp = arg;
+	int key;
+	char tag;
+	if (fscanf(fp, "%d %c", &key, &tag) != 2) {
+		return NULL;
+	}
+	Record *r = malloc(sizeof(Record));
+	r->key = key;
+	r->tag = tag;
+	return r;
+}
+
+unsigned long by_key(void *arg, int numpartitions, void *ctx)
+{
+	(void)ctx;
+	return ((Record *)arg)->key % numpartitions;
+}
+
+int straggler_claimed = 0;
+__thread int straggler; // this worker is the slow one
+long calls = 0;
+
+/* Leaves its input alone and returns a new record with the key doubled. The
+ * first worker to map a record of partition 0 stays slow on that partition. */
+void *double_key(void *arg)
+{
+	Record *r = arg;
+	__atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+	if (r->key % PARTITIONS == 0) {
+		if (__atomic_exchange_n(&straggler_claimed, 1, __ATOMIC_RELAXED) == 0) {
+			straggler = 1;
+		}
+		if (straggler) {
+			usleep(SLOW_MICROS);
+		}
+	}
+	Record *out = malloc(sizeof(Record));
+	out->key = r->key * 2;
+	out->tag = r->tag;
+	return out;
+}
+
+long keysum;
+
+void sum_keys(void *arg)
+{
+	keysum += ((Record *)arg)->key;
+}
+
+int failures = 0;
+
+void check(const char *what, long got, long want)
+{
+	printf("%-40s %8ld %s\n", what, got, got == want ? "ok" : "FAILED");
+	if (got != want) {
+		printf("    expected %ld\n", want);
+		failures++;
+	}
+}
+
+/* maps the partitioned input once and checks the output */
+void run(char **files, long want_sum)
+{
+	calls = 0;
+	straggler_claimed = 0;
+	keysum = 0;
+
+	RDD *part = partitionBy(map(RDDFromFiles(files, NUMFILES), parse), by_key, PARTITIONS, NULL);
+	RDD *doubled = map(part, double_key);
+	check("  records", count(doubled), NUMFILES * LINES);
+	print(doubled, sum_keys);
+	check("  sum of doubled keys", keysum, want_sum);
+}
+
+int main()
+{
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	char *files[NUMFILES];
+	long want_sum = 0;
+	for (int f = 0; f < NUMFILES; f++) {
+		files[f] = malloc(96);
+		snprintf(files[f], 96, "%s/in%d.txt", dir, f);
+		FILE *fp = fopen(files[f], "w");
+		for (int i = 0; i < LINES; i++) {
+			int key = (i * 13 + f) % KEYS;
+			fprintf(fp, "%d %c\n", key, "abc"[i % 3]);
+			want_sum += key * 2;
+		}
+		fclose(fp);
+	}
+
+	MS_RunBounded(4, 4);
+
+	printf("speculation off:\n");
+	run(files, want_sum);
+	check("  one mapper call per record", calls, NUMFILES * LINES);
+
+	printf("speculation on:\n");
+	MS_SetSpeculation(1);
+	run(files, want_sum);
+	check("  straggler was speculated", calls > NUMFILES * LINES, 1);
+
+	MS_TearDown();
+
+	for (int f = 0; f < NUMFILES; f++) {
+		unlink(files[f]);
+		free(files[f]);
+	}
+	rmdir(dir);
+
+	printf("%s\n", failures ? "FAILED" : "all speculation checks passed");
+	return failures ? 1 : 0;
+}